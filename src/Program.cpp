@@ -1,5 +1,7 @@
 #include <iostream>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "misc/Window.h"
 #include "core/Renderer.h"
 #include "core/Buffer.h"
@@ -35,6 +37,10 @@ Camera camera((float)Width / Height, glm::radians(45.0f),  900.0f * kCameraSetti
 
 bool needResetSamples = false;
 
+// F3 writes the image every this many samples, for looking at how a render converges
+constexpr uint32_t kCaptureSequenceInterval = 16;
+constexpr CaptureFormat kCaptureSequenceFormat = CaptureFormat::EXR_HALF;
+
 void MouseCallback(GLFWwindow* Window, double X, double Y) {
 	if (lockCamera) return;
 	glm::vec2 CurrentCursorPosition = glm::vec2(X, Y);
@@ -57,6 +63,10 @@ int main(int argc, char** argv) {
 #if _WIN32
 	SetThreadExecutionState(ES_CONTINUOUS | ES_SYSTEM_REQUIRED | ES_AWAYMODE_REQUIRED); // prevent our program from sleeping on windows for long renders
 #endif
+	// Worker processes of the distributed reference renderer, see Renderer::RenderReferenceDistributed
+	if (argc == 5 && strcmp(argv[1], "--worker") == 0)
+		return Renderer::RunReferenceWorker(argv[2], argv[3], (uint16_t)atoi(argv[4]));
+
 	std::cout << "Working Directory: " << argv[0] << '\n';
 
 	Window Window;
@@ -98,6 +108,8 @@ int main(int argc, char** argv) {
 
 	Window.SetVisibility(true);
 
+	bool screenshotKeyDown = false, sequenceKeyDown = false;
+
 	int numFrames = 0;
 	auto start = GetCurrentTimeNano64();
 	while (!Window.ShouldClose()) {
@@ -124,10 +136,16 @@ int main(int argc, char** argv) {
 
 		Window.Update();
 
-		// Take screenshot at the end of rendering
-		if (Window.GetKey(GLFW_KEY_F2)) {
+		// Captures no longer stall the frame, so they only go off when the key goes down instead of every frame it is held
+		bool screenshotKey = Window.GetKey(GLFW_KEY_F2), sequenceKey = Window.GetKey(GLFW_KEY_F3);
+		if (screenshotKey && !screenshotKeyDown) {
 			renderer->SaveScreenshot("res/screenshots/" + std::to_string(std::time(nullptr)) + ".png");
 		}
+		else if (sequenceKey && !sequenceKeyDown) {
+			bool recording = (renderer->GetCaptureInterval() == 0);
+			renderer->SetCaptureInterval(recording ? kCaptureSequenceInterval : 0, kCaptureSequenceFormat);
+			std::cout << (recording ? "Started" : "Stopped") << " capturing every " << kCaptureSequenceInterval << " samples\n";
+		}
 		else if (Window.GetKey(GLFW_KEY_R)) {
 			std::cout << "RENDERING REFERENCE Go grab a cup of coffee. This is going to take a while.\n";
 			Timer referenceTimer;
@@ -138,6 +156,16 @@ int main(int argc, char** argv) {
 			referenceTimer.End();
 			referenceTimer.DebugTime();
 		}
+		else if (Window.GetKey(GLFW_KEY_D)) {
+			std::cout << "RENDERING DISTRIBUTED REFERENCE\n";
+			renderer->RenderReferenceDistributed(camera);
+		}
+		else if (Window.GetKey(GLFW_KEY_B)) {
+			renderer->BenchmarkTraversal(camera);
+		}
+
+		screenshotKeyDown = screenshotKey;
+		sequenceKeyDown = sequenceKey;
 
 		FrameTimer.End();
 		FrameTimer.DebugTime();
@@ -5,8 +5,10 @@
 #include "../math/Triangle.h"
 #include "../math/TriangleIndexing.h"
 #include "../math/AABB.h"
+#include "../misc/ArrayView.h"
 
 #include <vector>
+#include <string>
 #include <stdint.h>
 
 #include <glm/glm.hpp>
@@ -28,6 +30,8 @@ enum class NodeType {
 };
 
 #define MAX_LEAF_TRIANGLES 15
+// Entries in the traversal stacks, also in BVH.glsl. The sweep builder keeps its leaves at most this deep so they never overflow
+#define BVH_STACK_SIZE 27
 struct NodeSerialized : public Hittable {
 
 	void MakeLeaf(void);
@@ -42,7 +46,51 @@ struct NodeSerialized : public Hittable {
 
 	int32_t secondChild; // al 32 bits are used to reference the second child
 
-	bool Intersect(const Ray& ray, HitInfo& hit, const std::vector<CompactTriangle>& triangles, const std::vector<int32_t>& references);
+	bool Intersect(const Ray& ray, const ShearedRay& sheared, HitInfo& hit, const std::vector<CompactTriangle>& triangles, const std::vector<int32_t>& references);
+};
+
+// Counters filled in by the CPU traversal when it is given somewhere to put them, used by the traversal benchmark
+struct TraversalStatistics {
+	TraversalStatistics(void);
+
+	uint64_t boxTests;
+	uint64_t boxHits;
+	uint64_t falseBoxHits; // Quantized box was hit even though the full precision box was missed
+	uint64_t triangleTests;
+
+	void Add(const TraversalStatistics& other);
+};
+
+bool IntersectLeaf(int32_t leaf, const Ray& ray, const ShearedRay& sheared, HitInfo& hit, ArrayView<CompactTriangle> triangles, ArrayView<int32_t> references, TraversalStatistics* stats = nullptr);
+
+// Leaf ordered triangles sit at the same offsets as the references they replace, and the last triangle of a leaf has this in its padding
+constexpr uint32_t kLeafEndMarker = 1;
+
+bool IntersectLeafOrdered(int32_t leaf, const Ray& ray, const ShearedRay& sheared, HitInfo& hit, const std::vector<CompactTriangle>& leafTriangles, TraversalStatistics* stats = nullptr);
+
+/*
+Compressed version of a child pair [Mahovsky and Wyvill 2006]
+Instead of full float boxes, each child box is stored relative to the box of its parent with QUANTIZED_BVH_BITS bits per plane
+The parent box comes from decoding the parent itself during traversal, so only the root has to be stored at full precision
+Child boxes are always rounded outward, so a quantized box can only give false positives and never miss geometry
+8 bits gives 20 bytes per pair and 16 bits gives 32 bytes per pair, compared to 64 bytes for a pair of NodeSerialized
+*/
+#define QUANTIZED_BVH_BITS 8
+
+#if QUANTIZED_BVH_BITS == 8
+typedef uint8_t QuantizedPlane;
+#else
+typedef uint16_t QuantizedPlane;
+#endif
+
+constexpr uint32_t kQuantizedMax = (1u << QUANTIZED_BVH_BITS) - 1u;
+
+struct QuantizedNode {
+	QuantizedPlane childMin[2][3];
+	QuantizedPlane childMax[2][3];
+	int32_t children[2]; // Quantized node index of each child, or the negated leaf offset like NodeSerialized::triangleRange
+
+	AABB Decode(const AABB& parent, int child) const;
 };
 
 // BVH triangle
@@ -51,58 +99,84 @@ struct TriangleCentroid {
 	uint32_t Index;
 };
 
-struct NodeUnserialized {
-	NodeUnserialized(void);
-
-	AABB BoundingBox;
-
-	std::vector<TriangleCentroid> Centroids;
+// A piece of a triangle that the builders work with. Splitting a triangle gives multiple references with the same index but smaller boxes
+struct TriangleReference {
+	int index;
+	AABB box;
+	glm::vec3 centroid;
+};
 
-	NodeUnserialized* parent;
-	//union {
-		NodeUnserialized* Children[2];
-		LeafPointer Leaf;
-	//};
+/*
+How many extra references splitting triangles is allowed to create over the whole tree, either by spatial splits in the SBVH builder or by presplitting
+Either a fraction of the number of triangles or an absolute count, so that memory use stays predictable on scenes that love to be split
+*/
+struct DuplicationBudget {
+	float fraction;
+	int count; // Used instead of the fraction when it is not negative
 
-	NodeType Type;
-	int32_t Index;
+	DuplicationBudget(void) : fraction(0.1f), count(-1) {}
 
-	int32_t SplitAxis;
+	static DuplicationBudget Fraction(float fraction);
+	static DuplicationBudget Absolute(int count);
+	static DuplicationBudget None(void);
 
-	float ComputeSAH(void);
+	int Resolve(int numTriangles) const;
 };
 
-struct Split {
-	Split(void);
-	// Axis of the split. 0-X, 1-Y, 2-Z
-	int32_t Axis;
-	// List of centroids. 0 is behind of the split, 1 is infornt of it
-	std::vector<TriangleCentroid> Centroids[2];
-	// Boxes formed by the split
-	AABB Box[2];
-	// SAH score of the split
-	float SAH;
-
-	float ComputeSAH(void);
-};
+/*
+Early split clipping: chops up triangles whose boxes are much bigger than the triangles themselves before any builder sees them [Ernst and Greiner 2007]
+The budget is handed out like in Karras and Aila 2013, where the worst triangles get the most splits
+Expects the triangle positions to be vertices, not the edges that Moller-Trumbore precomputes
+*/
+std::vector<TriangleReference> PresplitTriangles(const std::vector<CompactTriangle>& triangles, const DuplicationBudget& budget);
 
 class BoundingVolumeHierarchy {
 public:
-	void BuildFullSweep(std::vector<CompactTriangle>& triangles);
-	void BuildBinnedSpatial(std::vector<CompactTriangle>& triangles);
+	void BuildFullSweep(std::vector<CompactTriangle>& triangles, const DuplicationBudget& presplitBudget = DuplicationBudget::None());
+	void BuildBinnedSpatial(std::vector<CompactTriangle>& triangles, const DuplicationBudget& budget = DuplicationBudget(), const DuplicationBudget& presplitBudget = DuplicationBudget::None());
+	// Streams references through bucket files in scratchDirectory so that the builder's own data never takes more than memoryLimit bytes
+	void BuildOutOfCore(std::vector<CompactTriangle>& triangles, size_t memoryLimit, const std::string& scratchDirectory = "cache/bvh/");
+	// Roughly how much memory the in core builders need for this many triangles, which is what BuildOutOfCore keeps under its limit
+	static size_t GetBuildMemory(size_t numTriangles);
+
+	// Builds the quantized node pairs from the current nodes
+	void EncodeQuantized(void);
+
+	// Copies the triangles into leaf order so that traversal can skip the reference indirection, see leafOrderedTriangles in BVH.glsl
+	// Takes the triangles as the renderer sees them, so call this after any precomputation on them
+	void BuildLeafOrderedTriangles(const std::vector<CompactTriangle>& triangles);
+
+	// Hash of the serialized nodes and references. Builds are deterministic, so the same scene and settings always give the same hash no matter the thread count
+	uint64_t ComputeHash(void) const;
+
+	// The builders only touch CPU memory so that they can run on a background thread; the GL side is created here and must be done on the thread that owns the context
+	void Upload(void);
+	void Free(void);
 private:
 	friend class Shader;
 	friend class Renderer;
 
+	// Keeps the finished nodes and references around until Upload is called
+	void StoreHierarchy(const std::vector<NodeSerialized>& nodes, const std::vector<int32_t>& references);
+
 	std::vector<NodeSerialized> nodesVec;
 	std::vector<int32_t> referenceVec;
 
+	// Quantized node i is the pair of nodesVec[2 * i + 1] and nodesVec[2 * i + 2]
+	std::vector<QuantizedNode> quantizedNodesVec;
+
+	// leafTriangleVec[i] is the triangle referenceVec[i] points to, empty unless BuildLeafOrderedTriangles was called
+	std::vector<CompactTriangle> leafTriangleVec;
+
 	Buffer nodesBuf;
 	TextureBuffer nodesTex;
 	
 	Buffer referenceBuf;
 	TextureBuffer referenceTex;
 
+	Buffer leafTriangleBuf;
+	TextureBuffer leafTriangleTex;
+
 	//AABB CreateBoundingBox(const std::vector<TriangleCentroid>& Centroids, const std::vector<AABB>& TriangleBoundingBoxes);
 
 	//std::vector<TriangleCentroid> SortAxis(const std::vector<TriangleCentroid>& Centroids, uint32_t Axis);
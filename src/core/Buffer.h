@@ -7,6 +7,7 @@ enum BufferTarget {
 	BUFFER_TARGET_ARRAY = GL_ARRAY_BUFFER,
 	BUFFER_TARGET_SHADER_STORAGE = GL_SHADER_STORAGE_BUFFER,
 	BUFFER_TARGET_ATOMIC_COUNTER = GL_ATOMIC_COUNTER_BUFFER,
+	BUFFER_TARGET_PIXEL_PACK = GL_PIXEL_PACK_BUFFER,
 };
 
 class Buffer {
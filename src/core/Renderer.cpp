@@ -13,6 +13,22 @@
 #include <thread>
 #include <mutex>
 #include <bitset>
+#include <atomic>
+#include <future>
+#include <algorithm>
+#include <filesystem>
+#include <type_traits>
+#include <string.h>
+#include <deque>
+#include <condition_variable>
+#include "../misc/TimeUtil.h"
+#include "../misc/PerfCounters.h"
+#include "../math/Random.h"
+#include "../math/BlueNoise.h"
+#include "../misc/MappedFile.h"
+#include "../misc/Network.h"
+#include "../misc/Process.h"
+#include "../math/Distribution.h"
 
 using namespace glm;
 constexpr float kExposure = 1.68f;
@@ -24,6 +40,8 @@ const vec3 sunDir = normalize(vec3(2.0f, 40.0f + 29.0f, 12.0f));
 constexpr float sunAngle = glm::radians(5.0f);
 const float sunRadius = tan(sunAngle);
 const float sunMaxDot = cos(sunAngle);
+// Lives with the rest of the reference renderer's light sampling further down
+void BuildEnvironmentDistribution(const TextureCubemap& environment, Distribution2D& distribution);
 
 /*
 When we trace a ray, we don't actually care about the ray, we care about the path
@@ -180,60 +198,23 @@ void DebugMessageCallback(GLenum source, GLenum type, GLuint id,
         id, _type, _severity, _source, msg);
 }
 
-float HybridTaus(uvec4& state);
+// Number of frames we time each leaf layout for before settling on the faster one
+constexpr uint32_t kLeafLayoutTrialFrames = 16;
 
-// See jacco bikker's lecture http://www.cs.uu.nl/docs/vakken/magr/2016-2017/slides/lecture%2008%20-%20variance%20reduction.pdf
-// Also take a look at PBRT https://www.pbr-book.org/3ed-2018/Sampling_and_Reconstruction/Stratified_Sampling
-constexpr uint32_t kNumStrataPerSide = 4;
-constexpr uint32_t kNumStrata = kNumStrataPerSide * kNumStrataPerSide;
+constexpr size_t kMaxCaptureReadbacks = 4; // A whole frame of floats each, once this many are in flight a new capture waits for the oldest
 
-void GenerateStratifiedSamplesForPixel(vec2* samples, uvec4& seed) {
-    for (uint32_t y = 0; y < kNumStrataPerSide; y++) {
-        for (uint32_t x = 0; x < kNumStrataPerSide; x++) {
-            uint32_t index = x + y * kNumStrataPerSide;
-            samples[index] = vec2(x + HybridTaus(seed), y + HybridTaus(seed)) / float(kNumStrataPerSide);
-        }
-    }
-
-    std::shuffle(samples, samples + kNumStrata, std::default_random_engine(seed.x));
-}
-
-void GenerateStratifiedSamples(vec2* samples, uint32_t width, uint32_t height, bool& signal, bool& running) {
-    // Each pixel has its own set of stratified samples to prevent any sort of correlation that might arise due to permuation
-    // The idea is that we keep on updating our samples and then send them over to the GPU every KNumStratifiedSamples frames
-    // To not stress the main rendering thread, I will be doing this on another thread
-    // If signal = true, then that means we have already created our sample set and are waiting for it to be uploaded by the rendering thread
-    // If signal = false, then we need to generate a new sample set
-
-    // Gen initial numbers
-    std::default_random_engine rng;
-    std::uniform_int_distribution<uint32_t> dist(129, UINT32_MAX);
-    uvec4 seed;
-    seed.x = dist(rng);
-    seed.y = dist(rng);
-    seed.z = dist(rng);
-    seed.w = dist(rng);
-
-    while (running) {
-        // Wait until our samples have been uploaded before moving onto the next set of samples
-        while (signal) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        }
-
-        // samples is a very large area of consiting of width * height * KNumStratifiedSamples
-        for (uint32_t y = 0; y < height; y++) {
-            for (uint32_t x = 0; x < width; x++) {
-                uint32_t base = kNumStrata * (x + y * width);
-                GenerateStratifiedSamplesForPixel(samples + base, seed);
-            }
-
-        }
-
-        signal = true;
+const char* GetCaptureExtension(CaptureFormat format) {
+    switch (format) {
+    case CaptureFormat::PNG:
+        return ".png";
+    case CaptureFormat::PFM:
+        return GetHDRExtension(HDRFormat::PFM);
+    default:
+        return GetHDRExtension(HDRFormat::EXR_FLOAT);
     }
 }
 
-void LoadEnvironmnet(TextureCubemap* environment, const std::string& args, VertexArray& arr) {
+void LoadEnvironmnet(TextureCubemap* environment, const std::string& args) {
     std::string extension = args.substr(args.find_last_of('.') + 1);
     if (args.find_first_of("GENERATE") == 0) {
         std::stringstream parser(args);
@@ -260,60 +241,9 @@ void LoadEnvironmnet(TextureCubemap* environment, const std::string& args, Verte
         }
     }
     else if (extension == "hdr" || extension == "jpg") {
-        arr.CreateBinding();
-        int width, height, channels;
-        float* hdrData = stbi_loadf(args.c_str(), &width, &height, &channels, SOIL_LOAD_RGBA);
-        if (hdrData == nullptr) exit(-1);
-        Texture2D hdrTex;
-        hdrTex.CreateBinding();
-        hdrTex.LoadData(GL_RGBA32F, GL_RGBA, GL_FLOAT, width, height, hdrData);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        hdrTex.BindTextureUnit(0, GL_TEXTURE_2D);
-        stbi_image_free(hdrData);
-
-        ShaderRasterization equirectangularConverter;
-        equirectangularConverter.CompileFiles("EquirectangularConverter.vert", "EquirectangularConverter.frag");
-        equirectangularConverter.CreateBinding();
-        equirectangularConverter.LoadInteger("hdrTex", 0);
-        equirectangularConverter.LoadMat4x4F32("captureProjection", glm::perspective(glm::radians(90.0f), 1.0f, 0.1f, 10.0f));
-
-
         constexpr uint32_t cubemapSize = 1024;
-        environment->CreateBinding();
-        glTexStorage2D(GL_TEXTURE_CUBE_MAP, 1, GL_RGB32F, cubemapSize, cubemapSize);
-        glViewport(0, 0, cubemapSize, cubemapSize);
-
-        GLuint fbo;
-        glGenFramebuffers(1, &fbo);
-        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-
-        mat4 captureViews[] =
-        {
-           lookAt(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(1.0f,  0.0f,  0.0f), glm::vec3(0.0f, -1.0f,  0.0f)),
-           lookAt(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(-1.0f,  0.0f,  0.0f), glm::vec3(0.0f, -1.0f,  0.0f)),
-           lookAt(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f,  1.0f,  0.0f), glm::vec3(0.0f,  0.0f,  1.0f)),
-           lookAt(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f,  0.0f), glm::vec3(0.0f,  0.0f, -1.0f)),
-           lookAt(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f,  0.0f,  1.0f), glm::vec3(0.0f, -1.0f,  0.0f)),
-           lookAt(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f,  0.0f, -1.0f), glm::vec3(0.0f, -1.0f,  0.0f))
-        };
-
-        for (int i = 0; i < 6; i++) {
-            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, environment->GetHandle(), 0);
-            equirectangularConverter.LoadMat4x4F32("captureView", captureViews[i]);
-            glDrawArrays(GL_TRIANGLES, 0, 36);
-        }
-
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glDeleteFramebuffers(1, &fbo);
-
-        for (int i = 0; i < 6; i++) {
-            float* download = new float[4ULL * cubemapSize * cubemapSize];
-            glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, GL_FLOAT, download);
-            environment->GetFace(i).SaveData(GL_FLOAT, cubemapSize, cubemapSize, download);
-        }
+        if (!environment->LoadEquirectangular(args, cubemapSize)) exit(-1);
+        environment->UploadFaces();
     }
     else environment->LoadTexture(args); // Load TXT file
 
@@ -464,63 +394,16 @@ void Renderer::Initialize(Window* Window, const char* scenePath, const std::stri
     glEnable(GL_DEBUG_OUTPUT);
     glDebugMessageCallback(DebugMessageCallback, NULL);
 
-    float cube[] = {
-        // back face
-        -1.0f, -1.0f, -1.0f, 
-         1.0f,  1.0f, -1.0f, 
-         1.0f, -1.0f, -1.0f,        
-         1.0f,  1.0f, -1.0f, 
-        -1.0f, -1.0f, -1.0f, 
-        -1.0f,  1.0f, -1.0f, 
-        // front face
-        -1.0f, -1.0f,  1.0f, 
-         1.0f, -1.0f,  1.0f, 
-         1.0f,  1.0f,  1.0f, 
-         1.0f,  1.0f,  1.0f, 
-        -1.0f,  1.0f,  1.0f, 
-        -1.0f, -1.0f,  1.0f, 
-        // left face
-        -1.0f,  1.0f,  1.0f, 
-        -1.0f,  1.0f, -1.0f, 
-        -1.0f, -1.0f, -1.0f, 
-        -1.0f, -1.0f, -1.0f, 
-        -1.0f, -1.0f,  1.0f, 
-        -1.0f,  1.0f,  1.0f, 
-        // right face
-         1.0f,  1.0f,  1.0f, 
-         1.0f, -1.0f, -1.0f, 
-         1.0f,  1.0f, -1.0f,        
-         1.0f, -1.0f, -1.0f,
-         1.0f,  1.0f,  1.0f,
-         1.0f, -1.0f,  1.0f,    
-        // bottom face
-        -1.0f, -1.0f, -1.0f,
-         1.0f, -1.0f, -1.0f, 
-         1.0f, -1.0f,  1.0f, 
-         1.0f, -1.0f,  1.0f, 
-        -1.0f, -1.0f,  1.0f, 
-        -1.0f, -1.0f, -1.0f, 
-        // top face
-        -1.0f,  1.0f, -1.0f, 
-         1.0f,  1.0f , 1.0f, 
-         1.0f,  1.0f, -1.0f,    
-         1.0f,  1.0f,  1.0f, 
-        -1.0f,  1.0f, -1.0f, 
-        -1.0f,  1.0f,  1.0f,        
-    };
-
-    cubeBuf.CreateBinding(BUFFER_TARGET_ARRAY);
-    cubeBuf.UploadData(sizeof(cube), cube, GL_STATIC_DRAW);
-
-    cubeArr.CreateBinding();
-    cubeArr.CreateStream(0, 3, 3 * sizeof(float));
+    // The blue noise tiles take a few seconds to generate the first time, so we make them while the scene loads
+    std::future<std::vector<uint16_t>> blueNoiseTiles = std::async(std::launch::async, LoadBlueNoiseTiles);
 
     present.CompileFiles("Present.vert", "Present.frag");
     iterative.CompileFile("Iterative.comp");
 
     TextureCubemap* environment = new TextureCubemap;
-    LoadEnvironmnet(environment, env_path, cubeArr);
+    LoadEnvironmnet(environment, env_path);
     scene.LoadScene(scenePath, environment);
+    BuildEnvironmentDistribution(*environment, scene.environmentDistribution);
 
     glViewport(0, 0, viewportWidth, viewportHeight);
     float quad[] = {
@@ -562,6 +445,12 @@ void Renderer::Initialize(Window* Window, const char* scenePath, const std::stri
     ldSamplerStateBuf.CreateBinding(BUFFER_TARGET_SHADER_STORAGE);
     ldSamplerStateBuf.UploadData(ldSamplerStates, GL_STATIC_DRAW);
 
+    blueNoiseBuf.CreateBinding(BUFFER_TARGET_ARRAY);
+    blueNoiseBuf.UploadData(blueNoiseTiles.get(), GL_STATIC_DRAW);
+
+    blueNoiseTex.CreateBinding();
+    blueNoiseTex.SelectBuffer(&blueNoiseBuf, GL_R16UI);
+
     globalNextRayBuf.CreateBinding(BUFFER_TARGET_SHADER_STORAGE);
     globalNextRayBuf.UploadData(sizeof(int), nullptr, GL_DYNAMIC_DRAW);
 
@@ -603,10 +492,12 @@ void Renderer::Initialize(Window* Window, const char* scenePath, const std::stri
     accum.BindImageUnit(0, GL_RGBA32F);
     accum.BindTextureUnit(0, GL_TEXTURE_2D);
     scene.vertexTex.BindTextureUnit(1, GL_TEXTURE_BUFFER);
-    scene.bvh.nodesTex.BindTextureUnit(3, GL_TEXTURE_BUFFER);
-    scene.bvh.referenceTex.BindTextureUnit(6, GL_TEXTURE_BUFFER);
+    scene.bvh->nodesTex.BindTextureUnit(3, GL_TEXTURE_BUFFER);
+    scene.bvh->referenceTex.BindTextureUnit(6, GL_TEXTURE_BUFFER);
+    scene.bvh->leafTriangleTex.BindTextureUnit(7, GL_TEXTURE_BUFFER);
     scene.lightTex.BindTextureUnit(4, GL_TEXTURE_BUFFER);
     pixelPoolTex.BindTextureUnit(5, GL_TEXTURE_BUFFER);
+    blueNoiseTex.BindTextureUnit(8, GL_TEXTURE_BUFFER);
 
     iterative.CreateBinding();
     iterative.LoadInteger("accum", 0);
@@ -616,6 +507,9 @@ void Renderer::Initialize(Window* Window, const char* scenePath, const std::stri
     iterative.LoadInteger("lightTex", 4);
     iterative.LoadInteger("pixelPoolTex", 5);
     iterative.LoadInteger("referenceTex", 6);
+    iterative.LoadInteger("leafTriangleTex", 7);
+    iterative.LoadInteger("leafOrderedTriangles", 0);
+    iterative.LoadInteger("blueNoiseTex", 8);
     iterative.LoadFloat("totalLightArea", scene.totalLightArea);
     std::cout << scene.totalLightArea << "abcd\n";
     iterative.LoadShaderStorageBuffer("samplers", scene.materialsBuf);
@@ -633,9 +527,22 @@ void Renderer::Initialize(Window* Window, const char* scenePath, const std::stri
 
     frameCounter = 0;
     numSamples = 0;
+
+    captureInterval = 0;
+    captureIntervalFormat = CaptureFormat::PNG;
+    captureSequence = 0;
+
+    leafLayoutTrialFrame = 0;
+    leafLayoutTrialTime[0] = leafLayoutTrialTime[1] = 0.0;
 }
 
 void Renderer::CleanUp(void) {
+    // Captures still in flight need the GL context, so they have to finish first
+    FlushCaptures();
+    for (Buffer& buffer : freeCaptureBuffers)
+        buffer.Free();
+    freeCaptureBuffers.clear();
+
     // I hope the scene destructor frees its resources
     iterative.Free();
     present.Free();
@@ -649,6 +556,19 @@ void Renderer::CleanUp(void) {
 #define MEMORY_BARRIER_RT GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT | GL_ATOMIC_COUNTER_BARRIER_BIT
 
 void Renderer::RenderFrame(const Camera& camera)  {
+    // The refined BVH comes with new buffers, so the texture units have to point to them instead
+    if (scene.UpdateHierarchy()) {
+        scene.bvh->nodesTex.BindTextureUnit(3, GL_TEXTURE_BUFFER);
+        scene.bvh->referenceTex.BindTextureUnit(6, GL_TEXTURE_BUFFER);
+        scene.bvh->leafTriangleTex.BindTextureUnit(7, GL_TEXTURE_BUFFER);
+
+        // Which form is faster depends on the tree, so time them again
+        iterative.CreateBinding();
+        iterative.LoadInteger("leafOrderedTriangles", 0);
+        leafLayoutTrialFrame = 0;
+        leafLayoutTrialTime[0] = leafLayoutTrialTime[1] = 0.0;
+    }
+
     // Clear our atomic buf
     uint32_t clear = 0;
     globalNextRayBuf.CreateBinding(BUFFER_TARGET_SHADER_STORAGE);
@@ -656,11 +576,44 @@ void Renderer::RenderFrame(const Camera& camera)  {
 
     iterative.CreateBinding();
     iterative.LoadCamera(camera, viewportWidth, viewportHeight);
-    iterative.LoadInteger("stratumIdx", numSamples % kNumStrata);
+    // Every pixel has to be on the same sample for the error to come out as blue noise, see Random.glsl
+    iterative.LoadInteger("blueNoiseSample", numSamples);
+
+    /*
+    Both leaf forms give the exact same image, so we can keep accumulating while we figure out which one is faster
+    We alternate between them so that both see the same warmup and camera, and wait for each frame to finish so that we time only that frame
+    */
+    bool leafLayoutTrial = (!scene.bvh->leafTriangleVec.empty() && leafLayoutTrialFrame < 2 * kLeafLayoutTrialFrames);
+    Timer leafLayoutTimer;
+    if (leafLayoutTrial) {
+        iterative.LoadInteger("leafOrderedTriangles", leafLayoutTrialFrame % 2);
+        glFinish();
+        leafLayoutTimer.Begin();
+    }
+
     glDispatchCompute(2048, 1, 1); // My expriments reveal that the number of thread you launch DOES affect perforamnce, contrary to what Aila and Laine 2009 say. This value is handpicked for a GTX 980 
     glMemoryBarrier(MEMORY_BARRIER_RT);
     numSamples++;
 
+    if (captureInterval != 0 && numSamples % captureInterval == 0) {
+        char name[16];
+        snprintf(name, sizeof(name), "%08d", numSamples);
+        SaveScreenshot(captureSequencePath + name + GetCaptureExtension(captureIntervalFormat), captureIntervalFormat);
+    }
+    ServiceCaptures(kMaxCaptureReadbacks);
+
+    if (leafLayoutTrial) {
+        glFinish();
+        leafLayoutTimer.End();
+        leafLayoutTrialTime[leafLayoutTrialFrame % 2] += leafLayoutTimer.Delta;
+
+        if (++leafLayoutTrialFrame == 2 * kLeafLayoutTrialFrames) {
+            bool leafOrdered = (leafLayoutTrialTime[1] < leafLayoutTrialTime[0]);
+            iterative.LoadInteger("leafOrderedTriangles", leafOrdered);
+            std::cout << "References: " << 1000.0 * leafLayoutTrialTime[0] / kLeafLayoutTrialFrames << " ms/frame\tLeaf ordered triangles: " << 1000.0 * leafLayoutTrialTime[1] / kLeafLayoutTrialFrames << " ms/frame\tUsing " << (leafOrdered ? "leaf ordered triangles" : "references") << '\n';
+        }
+    }
+
     if (bindedWindow->GetKey(GLFW_KEY_P)) { 
         debugBuf.CreateBinding(BUFFER_TARGET_SHADER_STORAGE);
         int* ptr = (int*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
@@ -686,6 +639,9 @@ void Renderer::Present() {
 
 void Renderer::ResetSamples() {
     numSamples = 0;
+    // A new view gets its own sequence, the old one stays as it was
+    if (captureInterval != 0)
+        SetCaptureInterval(captureInterval, captureIntervalFormat);
     float clearcol[4] = { 0.0, 0.0, 0.0, 1.0 };
     glClearTexSubImage(accum.GetHandle(), 0, 0, 0, 0, viewportWidth, viewportHeight, 1, GL_RGBA, GL_FLOAT, clearcol);
 }
@@ -694,24 +650,15 @@ uint32_t Renderer::GetNumSamples() {
     return numSamples;
 }
 
-void Renderer::SaveScreenshot(const std::string& filename) {
-    if (SOIL_save_screenshot(filename.c_str(), SOIL_SAVE_TYPE_PNG, 0, 0, 1280, 720)) {
-        std::cout << "File \"" << filename << "\" saved successfully\n";
-    }
-    else {
-        std::cout << "File \"" << filename << "\" failed to save!\n";
-        exit(-1);
-    }
-}
-
-
-#define BVH_STACK_SIZE 27
-bool TraverseBVH(Ray ray, HitInfo& intersection, const std::vector<CompactTriangle>& triangles, const std::vector<NodeSerialized>& nodes, const std::vector<int32_t>& references) {
+// Leaves are tested against leafTriangles instead of going through the references when it is given
+bool TraverseBVH(Ray ray, HitInfo& intersection, ArrayView<CompactTriangle> triangles, ArrayView<NodeSerialized> nodes, ArrayView<int32_t> references, const std::vector<CompactTriangle>* leafTriangles = nullptr, TraversalStatistics* stats = nullptr) {
     Ray iray;
 
     iray.direction = 1.0f / ray.direction;
     iray.origin = -ray.origin * iray.direction;
 
+    ShearedRay sheared(ray);
+
     NodeSerialized root = nodes.front();
 
     if (!root.BoundingBox.Intersect(iray, intersection))
@@ -731,13 +678,19 @@ bool TraverseBVH(Ray ray, HitInfo& intersection, const std::vector<CompactTriang
         bool hit0 = child0.BoundingBox.Intersect(iray, intersection, distance0);
         bool hit1 = child1.BoundingBox.Intersect(iray, intersection, distance1);
 
-        if (hit0 && child0.triangleRange < 0) {
-            result |= child0.Intersect(ray, intersection, triangles, references);
+        if (stats) {
+            stats->boxTests += 2;
+            stats->boxHits += (int)hit0 + (int)hit1;
+        }
+
+        // Leaves store a negated offset, and an offset of 0 is still a leaf (same as IsLeafVal in BVH.glsl)
+        if (hit0 && child0.triangleRange <= 0) {
+            result |= (leafTriangles ? IntersectLeafOrdered(child0.triangleRange, ray, sheared, intersection, *leafTriangles, stats) : IntersectLeaf(child0.triangleRange, ray, sheared, intersection, triangles, references, stats));
             hit0 = false;
         }
 
-        if (hit1 && child1.triangleRange < 0) {
-            result |= child1.Intersect(ray, intersection, triangles, references);
+        if (hit1 && child1.triangleRange <= 0) {
+            result |= (leafTriangles ? IntersectLeafOrdered(child1.triangleRange, ray, sheared, intersection, *leafTriangles, stats) : IntersectLeaf(child1.triangleRange, ray, sheared, intersection, triangles, references, stats));
             hit1 = false;
         }
 
@@ -761,24 +714,94 @@ bool TraverseBVH(Ray ray, HitInfo& intersection, const std::vector<CompactTriang
     return result;
 }
 
-uint32_t TausStep(uint32_t& z, uint32_t s1, uint32_t s2, uint32_t s3, uint32_t m) {
-    uint b = (((z << s1) ^ z) >> s2);
-    z = (((z & m) << s3) ^ b);
-    return z;
-}
+// Same as TraverseBVH, but each child box has to be decoded from the box of its parent, so the stack also has to keep the boxes
+// When given the full precision nodes we also check each quantized box hit against them to count false positives
+bool TraverseQuantizedBVH(Ray ray, HitInfo& intersection, const std::vector<CompactTriangle>& triangles, const std::vector<QuantizedNode>& quantized, const std::vector<NodeSerialized>& nodes, const std::vector<int32_t>& references, TraversalStatistics* stats = nullptr) {
+    Ray iray;
 
-uint32_t LCGStep(uint32_t& z, uint32_t a, uint32_t c) {
-    z = a * z + c;
-    return z;
-}
+    iray.direction = 1.0f / ray.direction;
+    iray.origin = -ray.origin * iray.direction;
 
-float HybridTaus(uvec4& state) {
-    return 2.3283064365387e-10f * float(
-        TausStep(state.x, 13, 19, 12, 4294967294U) ^
-        TausStep(state.y, 2, 25, 4, 4294967288U) ^
-        TausStep(state.z, 3, 11, 17, 4294967280U) ^
-        LCGStep(state.w, 1664525, 1013904223U)
-    );
+    ShearedRay sheared(ray);
+
+    AABB frame = nodes.front().BoundingBox;
+    if (!frame.Intersect(iray, intersection))
+        return false;
+
+    // A root that is a leaf has no pairs to quantize, see EncodeQuantized
+    if (nodes.front().triangleRange <= 0)
+        return IntersectLeaf(nodes.front().triangleRange, ray, sheared, intersection, triangles, references, stats);
+
+    bool result = false;
+
+    struct StackEntry {
+        int32_t node;
+        AABB frame;
+    };
+
+    int32_t currentNode = 0;
+    StackEntry stack[BVH_STACK_SIZE];
+    int index = -1;
+
+    while (true) {
+        const QuantizedNode& node = quantized[currentNode];
+        AABB box0 = node.Decode(frame, 0);
+        AABB box1 = node.Decode(frame, 1);
+        int32_t child0 = node.children[0];
+        int32_t child1 = node.children[1];
+
+        vec2 distance0, distance1;
+        bool hit0 = box0.Intersect(iray, intersection, distance0);
+        bool hit1 = box1.Intersect(iray, intersection, distance1);
+
+        if (stats) {
+            stats->boxTests += 2;
+            stats->boxHits += (int)hit0 + (int)hit1;
+
+            const NodeSerialized& exact0 = nodes[2 * currentNode + 1];
+            const NodeSerialized& exact1 = nodes[2 * currentNode + 2];
+            stats->falseBoxHits += (int)(hit0 && !exact0.BoundingBox.Intersect(iray, intersection));
+            stats->falseBoxHits += (int)(hit1 && !exact1.BoundingBox.Intersect(iray, intersection));
+        }
+
+        if (hit0 && child0 <= 0) {
+            result |= IntersectLeaf(child0, ray, sheared, intersection, triangles, references, stats);
+            hit0 = false;
+        }
+
+        if (hit1 && child1 <= 0) {
+            result |= IntersectLeaf(child1, ray, sheared, intersection, triangles, references, stats);
+            hit1 = false;
+        }
+
+        if (hit0 && hit1) {
+            if (distance0.x > distance1.x) {
+                std::swap(child0, child1);
+                std::swap(box0, box1);
+            }
+            stack[++index] = { child1, box1 };
+            currentNode = child0;
+            frame = box0;
+        }
+        else if (hit0) {
+            currentNode = child0;
+            frame = box0;
+        }
+        else if (hit1) {
+            currentNode = child1;
+            frame = box1;
+        }
+        else
+            if (index == -1)
+                break;
+            else {
+                currentNode = stack[index].node;
+                frame = stack[index].frame;
+                index--;
+            }
+    }
+
+    return result;
 }
 
 // Implementation of "Golden Ratio Sequences For Low-Discrepancy Sampling"
@@ -993,196 +1016,1934 @@ vec3 ComputeTonemapUncharted2(vec3 color) {
     return color;
 }
 
-void PathTraceImage(
-    uint8_t* image, uint32_t x, uint32_t y, const uint32_t w, const uint32_t h, const Camera& camera,
-    const std::vector<CompactTriangle>& triangles,  const std::vector<NodeSerialized>& nodes, const std::vector<int32_t>& references,
-    const std::vector<MaterialInstance>& materials, const std::vector<Texture*>& textures, uvec4 state
-) {
-    vec3 pixel = vec3(0.0);
-
-    for (int i = 0; i < KNumRefSamples; i++) {
-        vec2 interpolation = vec2(x + HybridTaus(state), y + HybridTaus(state)) / vec2(w, h);
-        Ray ray = camera.GenRay(interpolation, HybridTaus(state), HybridTaus(state));
-        vec3 throughput = vec3(1.0);
-
-        while(true) {
-            HitInfo closest;
-
-            TraverseBVH(ray, closest, triangles, nodes, references);
-            closest.intersection.matId /= 2; // Not needed for the CPU
-
-            if (materials[closest.intersection.matId].isEmissive) {
-                vec3 emission;
-                if (closest.intersection.matId == 0) {
-                    const TextureCubemap* skybox = (const TextureCubemap*)textures.front();
-                    emission = skybox->Sample(ray.direction);
-                    if (dot(ray.direction, sunDir) >  sunMaxDot) {
-                        emission += materials[0].emission;
-                    }
-                }
-                else
-                    emission = materials[closest.intersection.matId].emission;
+/*
+The reference renderer takes its numbers either from Owen scrambled Sobol or from RandomStreams8, both keyed by the pixel, so every pixel comes out the same no matter which thread traces it
+Sobol converges faster, while the streams are there to check that it does not bias anything
+With the streams, we generate the first kRandomBlockDimensions numbers of eight samples at once and trace the samples one after the other
+The light and BRDF samples of every bounce start at a multiple of 4 dimensions so that each lands in its own Sobol group
+*/
+#define OWEN_SOBOL_REFERENCE
+constexpr RandomGenerator kReferenceRandomGenerator = RandomGenerator::PHILOX;
+constexpr uint32_t kRandomBlockDimensions = 32; // Camera plus the first 3 bounces, each taking 4 numbers for its light and 4 for its BRDF sample
 
-                pixel += throughput * emission;
-                break;
-            }
+struct SobolSampler {
+    SobolSampler(void) : pixel(0), sample(0), dimension(0) {}
+    SobolSampler(uint32_t pixel, uint32_t sample) : pixel(pixel), sample(sample), dimension(0) {}
+
+    float Next(void) {
+        return SobolOwen(pixel, sample, dimension++);
+    }
 
-            ray.origin = closest.intersection.position + closest.intersection.normal * 0.001f;
+    void StartBounce(void) {
+        dimension = (dimension + 3) & ~3U;
+    }
 
-            vec3 normcrs = (abs(closest.intersection.normal.y) > 0.99 ? vec3(1.0, 0.0, 0.0) : vec3(0.0, 1.0, 0.0));
-            vec3 tangent = normalize(cross(normcrs, closest.intersection.normal));
-            vec3 bitangent = cross(tangent, closest.intersection.normal);
+    uint32_t pixel;
+    uint32_t sample;
+    uint32_t dimension;
+};
 
-            vec3 viewDir = -ray.direction;
+// Hands out the numbers of one lane of a block, and goes back to the streams when a long path runs out of them
+struct LaneSampler {
+    LaneSampler(const RandomStreams8& streams, const float* block, uint32_t lane) : streams(streams), block(block), lane(lane), dimension(0) {}
 
-            // I do not take advantage of cosine sampling here (yet) to sit well with specular BRDFs at grazing angles
-            // https://mathworld.wolfram.com/SpherePointPicking.html
-            float phi = 2 * M_PI * HybridTaus(state);
-            float z = HybridTaus(state);
-            float r = sqrt(1.0f - z * z);
-            ray.direction = mat3(tangent, bitangent, closest.intersection.normal) * vec3(r * vec2(sin(phi), cos(phi)), z);
+    float Next(void) {
+        if (dimension < kRandomBlockDimensions)
+            return block[kRandomLanes * dimension++ + lane];
 
-            const Texture2D* tex = (const Texture2D*)textures[2ULL * closest.intersection.matId - 1ULL];
-            const Texture2D* mat = (const Texture2D*)textures[2ULL * closest.intersection.matId];
-            vec3 data = mat->Sample(closest.intersection.texcoord);
+        if (dimension % kRandomBlockDimensions == 0)
+            streams.Fill(overflow, dimension, kRandomBlockDimensions);
+        return overflow[kRandomLanes * (dimension++ % kRandomBlockDimensions) + lane];
+    }
 
-            float roughness = data.g * data.g;
-            float metalness = data.b;
+    void StartBounce(void) {
+        dimension = (dimension + 3) & ~3U;
+    }
 
-            throughput *= GGXCookTorrance(tex->Sample(closest.intersection.texcoord), roughness, metalness, closest.intersection.normal, viewDir, ray.direction) * 2.0f * M_PI * max(dot(closest.intersection.normal, ray.direction), 0.0f); // BRDF, we need to multiply by M_PI to account for cosine PDF
+    const RandomStreams8& streams;
+    const float* block;
+    uint32_t lane;
+    uint32_t dimension;
+    float overflow[kRandomLanes * kRandomBlockDimensions];
+};
 
-            float rr = min(max(throughput.x, max(throughput.y, throughput.z)), 1.0f);
-            if (HybridTaus(state) > rr)
-                break;
-            throughput /= rr;
+/*
+Next event estimation for the reference renderer, with the same strategies as Iterative.comp plus the environment map
+Every bounce samples one light, either a point on an emissive triangle (picked by area through the emitter CDF), a direction in the cone of the sun,
+or a direction from the environment map distribution
+Then it samples the BRDF to continue the path, picking between a cosine lobe and the GGX distribution of normals
+Both ways of reaching a light are weighted with the balance heuristic [Veach 1995], which keeps the small and bright sun from turning into fireflies
+*/
+constexpr float kEnvironmentLightProbability = 0.3f; // Only when the environment map is not black
+constexpr float kSunLightProbability = 0.5f; // Of what the environment leaves, and only when the scene has emissive triangles, otherwise the sun gets all of it
+constexpr float kShadowRayOffset = 0.001f;
+
+struct LightSample {
+    vec3 direction;
+    float distance;
+    float pdf; // Solid angle, including the chance of picking this kind of light
+    vec3 emission;
+};
+
+float BalanceHeuristic(float pdf, float otherPdf) {
+    return pdf / (pdf + otherPdf);
+}
+
+// Chance of sampling the diffuse lobe, based on how much energy the diffuse part of the BRDF keeps (see CalcDiffusePmf in Microfacet.glsl)
+// Clamped so that neither lobe is ever left out entirely
+float DiffuseLobeProbability(vec3 albedo, float metallic) {
+    vec3 f0 = mix(vec3(0.04f), albedo, metallic);
+    vec3 diffuseEnergy = (1.0f - metallic) * (1.0f - f0);
+    return clamp(dot(diffuseEnergy, vec3(0.2126f, 0.7152f, 0.0722f)), 0.1f, 0.9f);
+}
+
+float BRDFDirectionPdf(vec3 n, vec3 v, vec3 l, float roughness, float diffuseProbability) {
+    float ndl = dot(n, l);
+    if (ndl <= 0.0f)
+        return 0.0f;
+
+    vec3 h = normalize(v + l);
+    float pdfDiffuse = ndl / M_PI;
+    float pdfSpecular = GGX_Distribution(n, h, roughness) * max(dot(n, h), 0.0f) / (4.0f * max(dot(v, h), 1e-6f));
+    return mix(pdfSpecular, pdfDiffuse, diffuseProbability);
+}
+
+vec3 SampleBRDFDirection(const mat3& tbn, vec3 v, float roughness, float diffuseProbability, float lobe, float u0, float u1) {
+    float phi = 2.0f * M_PI * u1;
+    if (lobe < diffuseProbability) {
+        float radius = sqrt(u0);
+        return tbn * vec3(radius * vec2(sin(phi), cos(phi)), sqrt(1.0f - u0));
+    }
+
+    // Same as ImportanceSampleTrowbridgeReitz, then we reflect the view direction around the microfacet normal
+    float a2 = roughness * roughness;
+    float z2 = max((1.0f - u0) / (u0 * (a2 - 1.0f) + 1.0f), 0.0f);
+    float radius = sqrt(max(1.0f - z2, 0.0f));
+    vec3 h = tbn * vec3(radius * vec2(sin(phi), cos(phi)), sqrt(z2));
+    return 2.0f * dot(v, h) * h - v;
+}
+
+// https://pharr.org/matt/blog/2019/02/27/triangle-sampling-1
+LightSample SampleEmissiveTriangle(vec3 position, float selection, float u0, float u1, ArrayView<CompactTriangle> triangles, ArrayView<LightTriangleInfo> emitters, float totalLightArea, ArrayView<MaterialInstance> materials) {
+    float selectedArea = selection * totalLightArea;
+    auto emitter = std::upper_bound(emitters.begin(), emitters.end(), selectedArea, [](float area, const LightTriangleInfo& info) {
+        return area < info.area;
+    });
+    if (emitter == emitters.end())
+        emitter--;
+
+    const CompactTriangle& triangle = triangles[emitter->index];
+    vec3 position1 = triangle.position1, position2 = triangle.position2;
+#ifndef WATERTIGHT_INTERSECTION
+    position1 += triangle.position0;
+    position2 += triangle.position0;
+#endif
+
+    float sr = sqrt(u0);
+    float u = 1.0f - sr;
+    float v = u1 * sr;
+    vec3 lightPosition = triangle.position0 * u + position1 * v + position2 * (1.0f - u - v);
+
+    LightSample sample;
+    sample.distance = distance(lightPosition, position);
+    sample.direction = (lightPosition - position) / sample.distance;
+    float cosine = abs(dot(triangle.normal, sample.direction));
+    sample.pdf = (cosine > 0.0f ? sample.distance * sample.distance / (cosine * totalLightArea) : 0.0f);
+    sample.emission = materials[triangle.material / 2].emission;
+    return sample;
+}
+
+float SunConePdf(void) {
+    return 1.0f / (2.0f * M_PI * (1.0f - sunMaxDot));
+}
+
+// Uniform in the cone of directions the sun covers, instead of the disk one unit away that Iterative.comp uses
+LightSample SampleSun(float u0, float u1, ArrayView<MaterialInstance> materials) {
+    vec3 normcrs = (abs(sunDir.y) > 0.99 ? vec3(1.0, 0.0, 0.0) : vec3(0.0, 1.0, 0.0));
+    vec3 tangent = normalize(cross(normcrs, sunDir));
+    vec3 bitangent = cross(tangent, sunDir);
+
+    float z = 1.0f - u0 * (1.0f - sunMaxDot);
+    float r = sqrt(max(1.0f - z * z, 0.0f));
+    float phi = 2.0f * M_PI * u1;
+
+    LightSample sample;
+    sample.direction = mat3(tangent, bitangent, sunDir) * vec3(r * vec2(sin(phi), cos(phi)), z);
+    sample.distance = 1e20f;
+    sample.pdf = SunConePdf();
+    sample.emission = materials[0].emission;
+    return sample;
+}
+
+/*
+Importance sampling of the environment map [Pharr et al. 2016, section 14.2.4]
+The distribution is over the equirectangular parametrization of the sphere, with each cell weighted by the luminance of the cubemap times sin(theta),
+since the cells near the poles cover less solid angle. It is built from the cubemap rather than straight from the HDR,
+so the density follows exactly what the path tracer sees on a miss and it works for every kind of environment
+Cells are averaged from a few lookups each, since a single lookup could step right over a small bright sun
+*/
+constexpr uint32_t kEnvironmentDistributionWidth = 1024;
+constexpr uint32_t kEnvironmentDistributionHeight = kEnvironmentDistributionWidth / 2;
+constexpr uint32_t kEnvironmentDistributionSubsamples = 2; // Per side of a cell
+
+vec3 EquirectangularToDirection(vec2 point) {
+    float phi = 2.0f * M_PI * point.x;
+    float theta = M_PI * point.y;
+    return vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+}
+
+vec2 DirectionToEquirectangular(vec3 direction) {
+    float phi = atan2(direction.z, direction.x);
+    if (phi < 0.0f)
+        phi += 2.0f * M_PI;
+    return vec2(phi / (2.0f * M_PI), acos(clamp(direction.y, -1.0f, 1.0f)) / M_PI);
+}
+
+void BuildEnvironmentDistribution(const TextureCubemap& environment, Distribution2D& distribution) {
+    distribution.Build(kEnvironmentDistributionWidth, kEnvironmentDistributionHeight, [&environment](uint32_t x, uint32_t y) {
+        vec3 sum(0.0f);
+        for (uint32_t i = 0; i < kEnvironmentDistributionSubsamples; i++) {
+            for (uint32_t j = 0; j < kEnvironmentDistributionSubsamples; j++) {
+                vec2 offset = (vec2(j, i) + 0.5f) / (float)kEnvironmentDistributionSubsamples;
+                vec2 point = (vec2(x, y) + offset) / vec2(kEnvironmentDistributionWidth, kEnvironmentDistributionHeight);
+                sum += environment.Sample(EquirectangularToDirection(point));
+            }
         }
+
+        float luminance = dot(sum, vec3(0.2126f, 0.7152f, 0.0722f)) / (float)(kEnvironmentDistributionSubsamples * kEnvironmentDistributionSubsamples);
+        float sinTheta = sin(M_PI * (y + 0.5f) / kEnvironmentDistributionHeight);
+        // Anything that is not a sane radiance, like a NaN from a broken HDR, just does not get sampled
+        return (luminance > 0.0f && luminance < 1e30f ? luminance * sinTheta : 0.0f);
+    });
+}
+
+// Going from the unit square to the sphere stretches area by 2 pi^2 sin(theta)
+float EnvironmentPdf(const Distribution2D& distribution, vec3 direction) {
+    vec2 point = DirectionToEquirectangular(direction);
+    float sinTheta = sin(M_PI * point.y);
+    return (sinTheta > 0.0f ? distribution.Pdf(point) / (2.0f * M_PI * M_PI * sinTheta) : 0.0f);
+}
+
+LightSample SampleEnvironment(float u0, float u1, const Distribution2D& distribution, const TextureCubemap* environment) {
+    float pdf;
+    vec2 point = distribution.Sample(u0, u1, pdf);
+    float sinTheta = sin(M_PI * point.y);
+
+    LightSample sample;
+    sample.direction = EquirectangularToDirection(point);
+    sample.distance = 1e20f;
+    sample.pdf = (sinTheta > 0.0f ? pdf / (2.0f * M_PI * M_PI * sinTheta) : 0.0f);
+    sample.emission = environment->Sample(sample.direction);
+    return sample;
+}
+
+// Chance of each kind of light being picked for the light sample of a bounce
+struct LightSelection {
+    float sun;
+    float environment;
+    float triangles;
+};
+
+LightSelection SelectLights(ArrayView<LightTriangleInfo> emitters, const Distribution2D& environment) {
+    LightSelection selection;
+    selection.environment = (environment.IsEmpty() ? 0.0f : kEnvironmentLightProbability);
+    selection.sun = (1.0f - selection.environment) * (emitters.empty() ? 1.0f : kSunLightProbability);
+    selection.triangles = (emitters.empty() ? 0.0f : 1.0f - selection.sun - selection.environment);
+    return selection;
+}
+
+// Picks a kind of light with the first random number and samples it with the other two. The pdf includes the chance of the pick
+LightSample SampleLight(
+    const LightSelection& selection, vec3 position, float pick, float u0, float u1,
+    ArrayView<CompactTriangle> triangles, ArrayView<MaterialInstance> materials, ArrayView<LightTriangleInfo> emitters, float totalLightArea,
+    const Distribution2D& environment, const TextureCubemap* skybox
+) {
+    LightSample light;
+    if (pick < selection.sun) {
+        light = SampleSun(u0, u1, materials);
+        light.pdf *= selection.sun;
+    }
+    else if (pick < selection.sun + selection.environment || emitters.empty()) {
+        light = SampleEnvironment(u0, u1, environment, skybox);
+        light.pdf *= selection.environment;
+    }
+    else {
+        light = SampleEmissiveTriangle(position, min((pick - selection.sun - selection.environment) / selection.triangles, 1.0f), u0, u1, triangles, emitters, totalLightArea, materials);
+        light.pdf *= selection.triangles;
+    }
+    return light;
+}
+
+/*
+Adaptive sampling for the reference renderer
+Every pixel keeps a running mean of its color and the variance of its luminance with Welford's algorithm, so that we never have to store samples
+Pixels are traced in rounds, and a pixel is done once the standard error of its mean is below kAdaptiveRelativeError of its luminance
+Sample counts only ever double so that each pixel ends on a power of two, which is where Owen scrambled Sobol is best stratified
+Since the variance is measured as if the samples were independent, it overestimates the error of Sobol, so the test is on the safe side
+*/
+constexpr uint32_t kAdaptiveInitialSamples = 256;
+constexpr float kAdaptiveRelativeError = 0.01f; // 1% standard error, a little below what survives the 8 bit output in the midtones
+constexpr float kAdaptiveLuminanceFloor = 0.01f; // Keeps near-black pixels from asking for samples that would never be visible
+constexpr double kAdaptiveTimeBudget = 0.0; // In seconds, 0 for no limit. The current round is always finished
+
+struct PixelEstimate {
+    PixelEstimate(void) : mean(0.0f), luminanceMean(0.0f), luminanceM2(0.0f), numSamples(0) {}
+
+    void AddSample(vec3 radiance) {
+        numSamples++;
+        mean += (radiance - mean) / (float)numSamples;
+
+        float luminance = dot(radiance, vec3(0.2126f, 0.7152f, 0.0722f));
+        float delta = luminance - luminanceMean;
+        luminanceMean += delta / (float)numSamples;
+        luminanceM2 += delta * (luminance - luminanceMean);
+    }
+
+    float RelativeError(void) const {
+        float variance = (numSamples > 1 ? luminanceM2 / (numSamples - 1) : 0.0f);
+        return sqrt(variance / numSamples) / max(luminanceMean, kAdaptiveLuminanceFloor);
+    }
+
+    // How many samples the next round should bring this pixel to, or 0 if it has converged
+    uint32_t NextSampleCount(void) const {
+        float error = RelativeError();
+        if (numSamples >= KNumRefSamples || error <= kAdaptiveRelativeError)
+            return 0;
+
+        // The error falls with the square root of the sample count, so we can guess how many samples it still needs
+        float needed = numSamples * (error / kAdaptiveRelativeError) * (error / kAdaptiveRelativeError);
+        uint32_t total = 2 * numSamples;
+        while (total < needed && total < KNumRefSamples)
+            total *= 2;
+        return std::min(total, KNumRefSamples);
     }
 
-    pixel /= KNumRefSamples;
+    vec3 mean;
+    float luminanceMean;
+    float luminanceM2;
+    uint32_t numSamples;
+};
+
+/*
+The reference renderer keeps linear radiance and writes it out as HDR, the tonemapped images are only for looking at
+Tonemapping is its own pass over the radiance, so the same render can be exposed again later
+*/
+constexpr HDRFormat kReferenceHDRFormat = HDRFormat::EXR_FLOAT;
+
+vec3 TonemapReference(vec3 radiance) {
     //pixel = 1.0f - exp(-kExposure * pixel);
-    pixel = ComputeTonemapUncharted2(kExposure * pixel);
+    vec3 pixel = ComputeTonemapUncharted2(kExposure * radiance);
     pixel = pow(pixel, vec3(1.0f / 2.2f));
+    return clamp(pixel, vec3(0.0), vec3(1.0f));
+}
 
-    pixel = clamp(pixel, vec3(0.0), vec3(1.0f));
+// Used for the preview in the window while we render, rows from the bottom up like OpenGL
+void WriteReferencePixel(uint8_t* image, uint32_t x, uint32_t y, const uint32_t w, vec3 radiance) {
+    vec3 pixel = TonemapReference(radiance);
     uint64_t idx = 3ULL * (y * w + x);
     image[idx    ] = (uint8_t)(255.0f * pixel.r);
     image[idx + 1] = (uint8_t)(255.0f * pixel.g);
     image[idx + 2] = (uint8_t)(255.0f * pixel.b);
 }
 
+// 8 bit image with the rows flipped to go from the top down, which is what image files want
+std::vector<uint8_t> TonemapImage(const std::vector<vec3>& radiance, uint32_t w, uint32_t h) {
+    std::vector<uint8_t> image(3ULL * w * h);
+    for (uint32_t y = 0; y < h; y++) {
+        for (uint32_t x = 0; x < w; x++) {
+            WriteReferencePixel(image.data(), x, h - y - 1, w, radiance[(size_t)y * w + x]);
+        }
+    }
+    return image;
+}
 
-// Render the ground truth of the image on the CPU
-void Renderer::RenderReference(const Camera& camera) {
-    TestGoldenRatio();
-    auto filename = std::to_string(std::time(nullptr));
-    SaveScreenshot("res/screenshots/" + filename + '-' + std::to_string(numSamples) + "-RENDERED.png");
+/*
+Captures of the interactive renderer copy accum into a pixel buffer and put a fence after the copy, which lets the GPU do the readback whenever it gets to it
+Every frame we look at the oldest fences without waiting, and only map the buffers whose copy is done, so mapping never stalls the pipeline
+Only the copy out of the mapping happens on the render thread. Dividing by the sample count, tonemapping, and encoding are all left to the writer thread
+*/
+void Renderer::SaveScreenshot(const std::string& filename, CaptureFormat format) {
+    ServiceCaptures(kMaxCaptureReadbacks - 1);
 
-    uint64_t numPixels = (uint64_t) viewportWidth * viewportHeight;
-    uint8_t* image = new uint8_t[3ULL * numPixels];
+    CaptureReadback readback;
+    if (freeCaptureBuffers.empty()) {
+        readback.buffer.CreateBinding(BUFFER_TARGET_PIXEL_PACK);
+        readback.buffer.UploadData((size_t)viewportWidth * viewportHeight * sizeof(vec3), nullptr, GL_STREAM_READ);
+    }
+    else {
+        readback.buffer = freeCaptureBuffers.back();
+        freeCaptureBuffers.pop_back();
+        readback.buffer.CreateBinding(BUFFER_TARGET_PIXEL_PACK);
+    }
 
-    std::vector<ivec2> pixelTasks;
+    // The samples come from image stores, which a texture download only sees after this barrier
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    // With a pixel pack buffer bound the pointer is an offset into it, so this only queues the copy. Asking for RGB has the GPU drop alpha for us
+    glGetTextureImage(accum.GetHandle(), 0, GL_RGB, GL_FLOAT, (GLsizei)readback.buffer.GetSize(), nullptr);
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.buffer.FreeBinding();
+
+    readback.path = filename;
+    readback.format = format;
+    readback.numSamples = numSamples;
+    captureReadbacks.push_back(readback);
+}
 
-    for (uint32_t y = 0; y < viewportHeight; y++) {
-        for (uint32_t x = 0; x < viewportWidth; x++) {
-            size_t idx = 3ULL * (y * viewportWidth + x);
-            image[idx] = 0;
-            image[idx+1] = 0;
-            image[idx+2] = 0;
-            pixelTasks.emplace_back(x, y);
+void Renderer::SetCaptureInterval(uint32_t interval, CaptureFormat format) {
+    captureInterval = interval;
+    captureIntervalFormat = format;
+    captureSequencePath = "res/screenshots/" + std::to_string(std::time(nullptr)) + '-' + std::to_string(captureSequence++) + "-SEQUENCE/";
+}
+
+uint32_t Renderer::GetCaptureInterval() {
+    return captureInterval;
+}
+
+void Renderer::FlushCaptures() {
+    ServiceCaptures(0);
+    imageWriter.Flush();
+}
+
+void Renderer::ServiceCaptures(size_t maxPending) {
+    while (!captureReadbacks.empty()) {
+        CaptureReadback& readback = captureReadbacks.front();
+
+        // Polling does not flush, but the buffer swap at the end of the frame does that for us. Waiting has to flush, or it might wait forever
+        bool wait = (captureReadbacks.size() > maxPending);
+        GLenum status = glClientWaitSync(readback.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? UINT64_MAX : 0);
+        if (status == GL_TIMEOUT_EXPIRED) {
+            if (wait)
+                continue;
+            break;
         }
-    }
+        glDeleteSync(readback.fence);
 
-    std::default_random_engine generator;
-    std::uniform_int_distribution<uint32_t> distribution(129, UINT32_MAX);
+        size_t numTexels = (size_t)viewportWidth * viewportHeight;
+        std::vector<vec3> radiance(numTexels);
 
-    auto start = std::time(nullptr);
-    uint32_t nextTask = 0;
-    std::mutex taskMutex;
-    std::vector<std::thread> workers;
-    for (uint32_t i = 0; i < kNumWorkers; i++) {
-        workers.emplace_back(
-            [](
-            uint32_t& nextTask, std::mutex& taskMutex, uint8_t* image, const std::vector<ivec2>& pixelTasks, uint32_t w, uint32_t h, const Camera& camera,
-                const std::vector<CompactTriangle>& triangles, const std::vector<NodeSerialized>& nodes, const std::vector<int32_t>& references,
-                const std::vector<MaterialInstance>& materials, const std::vector<Texture*>& textures,
-                std::default_random_engine& generator, std::uniform_int_distribution<uint32_t>& distribution
-            ) {
-                while (true) {
-                    taskMutex.lock();
-                    uint32_t currentTask = nextTask++;
-                    uvec4 state;
-                    state.x = distribution(generator);
-                    state.y = distribution(generator);
-                    state.z = distribution(generator);
-                    state.w = distribution(generator);
-                    taskMutex.unlock();
-
-                    if (currentTask >= pixelTasks.size())
-                        return;
-
-                    PathTraceImage(image, pixelTasks[currentTask].x, pixelTasks[currentTask].y, w, h, camera, triangles, nodes, references, materials, textures, state);
-                }
-            },
-            std::ref(nextTask), std::ref(taskMutex), image, std::ref(pixelTasks), viewportWidth, viewportHeight, std::ref(camera), std::ref(scene.triangleVec), std::ref(scene.bvh.nodesVec), std::ref(scene.bvh.referenceVec), std::ref(scene.materialVec), std::ref(scene.textures), std::ref(generator), std::ref(distribution)
-        );
+        readback.buffer.CreateBinding(BUFFER_TARGET_PIXEL_PACK);
+        const void* texels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, numTexels * sizeof(vec3), GL_MAP_READ_BIT);
+        if (texels)
+            memcpy(radiance.data(), texels, numTexels * sizeof(vec3));
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        readback.buffer.FreeBinding();
+
+        if (texels)
+            WriteCapture(readback.path, readback.format, viewportWidth, viewportHeight, std::move(radiance), 1.0f / std::max(readback.numSamples, 1));
+        else
+            std::cout << "File \"" << readback.path << "\" failed to save!\n";
+
+        freeCaptureBuffers.push_back(readback.buffer);
+        captureReadbacks.pop_front();
     }
+}
 
-    bool renderInProgress = true;
-    std::thread progressUpdateThread([&renderInProgress](time_t start, uint32_t& nextTask, size_t pixelTasksSize) {
-            while (renderInProgress) {
-                std::this_thread::sleep_for(std::chrono::seconds(1));
-                std::cout << "Rendering " << 100.0f * nextTask / pixelTasksSize << "% complete\tTime remaining: " << (std::time(nullptr) - start) * ((float)pixelTasksSize - nextTask) / nextTask << " seconds\n";
-            }
-        }, start, std::ref(nextTask), pixelTasks.size()
-    );
+void Renderer::WriteCapture(const std::string& path, CaptureFormat format, uint32_t width, uint32_t height, std::vector<vec3> radiance, float scale) {
+    imageWriter.Enqueue([path, format, width, height, radiance = std::move(radiance), scale]() mutable {
+        if (scale != 1.0f) {
+            for (vec3& pixel : radiance)
+                pixel *= scale;
+        }
 
-    Texture2D pixels;
-    pixels.CreateBinding();
-    pixels.LoadData(GL_RGB, GL_RGB, GL_UNSIGNED_BYTE, viewportWidth, viewportHeight, image);
-    pixels.BindTextureUnit(15, GL_TEXTURE_2D);
+        bool written;
+        if (format == CaptureFormat::PNG)
+            written = WritePNG(path, width, height, TonemapImage(radiance, width, height));
+        else if (format == CaptureFormat::PFM)
+            written = WriteHDR(path, width, height, radiance, HDRFormat::PFM);
+        else
+            written = WriteHDR(path, width, height, radiance, format == CaptureFormat::EXR_HALF ? HDRFormat::EXR_HALF : HDRFormat::EXR_FLOAT);
 
-    //glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGB, viewportWidth, viewportHeight);
+        if (written)
+            std::cout << "File \"" << path << "\" saved successfully\n";
+    });
+}
 
-    ShaderRasterization imagePresent;
-    imagePresent.CompileFiles("extra/Image.vert", "extra/Image.frag");
-    imagePresent.CreateBinding();
-    imagePresent.LoadInteger("image", 15);
+/*
+Long reference renders get checkpointed so that a crash or a killed machine does not lose hours of work
+The checkpoint holds the per-pixel estimates and the targets of the current round. Since every sample is keyed by its pixel and index,
+a pixel's sample count is also the position of its random numbers, so picking up from numSamples continues the exact same render
+It is written to a temporary file that then replaces the old one, so there is always one complete checkpoint on disk
+*/
+constexpr const char* kReferenceCheckpointPath = "cache/ReferenceCheckpoint.BIN";
+constexpr double kReferenceCheckpointInterval = 300.0; // Seconds, on top of one checkpoint at the end of every round
+constexpr uint32_t kReferenceCheckpointVersion = 2;
+
+// Everything that has to match for a checkpoint to belong to the render we are about to start
+// The counts alone would happily resume a render of an edited scene, so the scene's contents are in here as hashes
+struct ReferenceRenderKey {
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t maxSamples, initialSamples;
+    float relativeError;
+    uint32_t sampler;
+    uint32_t numTriangles, numEmitters;
+    vec3 cameraPosition, cameraDirection;
+    float aspect, fov, focalDistance, lensRadius;
+    vec3 sunDirection;
+    float sunRadius, sunMaxDot;
+    uint64_t hierarchyHash, geometryHash, materialHash, environmentHash;
+};
 
-    while (nextTask < pixelTasks.size()) {
-        glClear(GL_COLOR_BUFFER_BIT);
-        //glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewportWidth, viewportHeight, GL_RGB, GL_UNSIGNED_BYTE, image);
-        pixels.LoadData(GL_RGB, GL_RGB, GL_UNSIGNED_BYTE, viewportWidth, viewportHeight, image);
+// Same FNV-1a as the BVH hash, fed field by field so that struct padding stays out of it
+struct ReferenceHasher {
+    uint64_t hash = 14695981039346656037ull;
 
-        glDrawArrays(GL_TRIANGLES, 0, 6);
-        bindedWindow->Update();
+    void Feed(const void* data, size_t size) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
     }
 
-    imagePresent.Free();
-    pixels.Free();
+    template<typename T>
+    void Feed(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "Only plain values can be hashed by their bytes");
+        Feed(&value, sizeof(T));
+    }
+};
 
-    for (std::thread& worker : workers)
-        worker.join();
+uint64_t HashGeometry(const std::vector<CompactTriangle>& triangles) {
+    ReferenceHasher hasher;
+    for (const CompactTriangle& triangle : triangles) {
+        hasher.Feed(triangle.position0);
+        hasher.Feed(triangle.position1);
+        hasher.Feed(triangle.position2);
+        hasher.Feed(triangle.texcoord0);
+        hasher.Feed(triangle.texcoord1);
+        hasher.Feed(triangle.texcoord2);
+        hasher.Feed(triangle.normal);
+        hasher.Feed(triangle.material);
+    }
+    return hasher.hash;
+}
 
-    renderInProgress = false;
-    progressUpdateThread.join();
-    auto deltaT = std::time(nullptr) - start;
+// The bindless handles are left out since GL hands out different ones every run
+uint64_t HashMaterials(const std::vector<MaterialInstance>& materials) {
+    ReferenceHasher hasher;
+    for (const MaterialInstance& material : materials) {
+        hasher.Feed(material.emission);
+        hasher.Feed(material.isEmissive);
+    }
+    return hasher.hash;
+}
 
-    uint8_t* flipped = new uint8_t[3ULL * numPixels];
-    // Flip the image now
-    for (uint32_t y = 0; y < viewportHeight; y++) {
-        for (uint32_t x = 0; x < viewportWidth; x++) {
-            size_t cidx = 3ULL * (y * viewportWidth + x);
-            size_t fidx = 3ULL * ((uint64_t)(viewportHeight - y - 1) * viewportWidth + x); // Flip the y
-            flipped[cidx] = image[fidx];
-            flipped[cidx + 1] = image[fidx + 1];
-            flipped[cidx + 2] = image[fidx + 2];
-        }
+struct ReferenceRenderProgress {
+    uint32_t round;
+    int64_t startTime; // So that the output keeps the name it would have had without the interruption
+    int64_t elapsedTime;
+};
+
+static_assert(std::is_trivially_copyable<PixelEstimate>::value, "Pixel estimates are written to the checkpoint as they are");
+
+bool SaveReferenceCheckpoint(const ReferenceRenderKey& key, const ReferenceRenderProgress& progress, const std::vector<PixelEstimate>& estimates, const std::vector<uint32_t>& targetSamples) {
+    std::string path = kReferenceCheckpointPath;
+    std::string temporaryPath = path + ".tmp";
+
+    std::filesystem::create_directories(path.substr(0, path.rfind('/')));
+    FILE* file = fopen(temporaryPath.c_str(), "wb");
+    if (!file) {
+        std::cout << "Could not open \"" << temporaryPath << "\" to checkpoint the reference render\n";
+        return false;
     }
 
-    SOIL_save_image(("res/screenshots/" + filename + '-' + std::to_string(deltaT) + "-REFERENCE.png").c_str(), SOIL_SAVE_TYPE_PNG, viewportWidth, viewportHeight, 3, flipped);
+    bool written =
+        fwrite(&key, sizeof(key), 1, file) == 1 &&
+        fwrite(&progress, sizeof(progress), 1, file) == 1 &&
+        fwrite(estimates.data(), sizeof(PixelEstimate), estimates.size(), file) == estimates.size() &&
+        fwrite(targetSamples.data(), sizeof(uint32_t), targetSamples.size(), file) == targetSamples.size();
+    written &= (fclose(file) == 0);
 
-    delete[] image;
-    delete[] flipped;
+    std::error_code error;
+    if (written)
+        std::filesystem::rename(temporaryPath, path, error);
 
-    std::cout << "Pssst? You still there? Rendering completed in " << deltaT << " seconds\n";
-}
\ No newline at end of file
+    if (!written || error) {
+        std::cout << "Failed to write the reference render checkpoint, the previous one is left as it was\n";
+        std::filesystem::remove(temporaryPath, error);
+        return false;
+    }
+
+    return true;
+}
+
+bool LoadReferenceCheckpoint(const ReferenceRenderKey& key, ReferenceRenderProgress& progress, std::vector<PixelEstimate>& estimates, std::vector<uint32_t>& targetSamples) {
+    FILE* file = fopen(kReferenceCheckpointPath, "rb");
+    if (!file)
+        return false;
+
+    ReferenceRenderKey savedKey;
+    bool valid = (fread(&savedKey, sizeof(savedKey), 1, file) == 1 && memcmp(&savedKey, &key, sizeof(key)) == 0);
+    if (!valid) {
+        std::cout << "Ignoring the reference render checkpoint since it belongs to a different render\n";
+        fclose(file);
+        return false;
+    }
+
+    // Read into copies so that a truncated file leaves the fresh state alone
+    ReferenceRenderProgress savedProgress;
+    std::vector<PixelEstimate> savedEstimates(estimates.size());
+    std::vector<uint32_t> savedTargets(targetSamples.size());
+    valid =
+        fread(&savedProgress, sizeof(savedProgress), 1, file) == 1 &&
+        fread(savedEstimates.data(), sizeof(PixelEstimate), savedEstimates.size(), file) == savedEstimates.size() &&
+        fread(savedTargets.data(), sizeof(uint32_t), savedTargets.size(), file) == savedTargets.size();
+    fclose(file);
+
+    if (!valid) {
+        std::cout << "Ignoring the reference render checkpoint since it is incomplete\n";
+        return false;
+    }
+
+    progress = savedProgress;
+    estimates = std::move(savedEstimates);
+    targetSamples = std::move(savedTargets);
+    return true;
+}
+
+/*
+Mip level selection with ray cones [Akenine-Moller et al. 2019] instead of ray differentials
+A cone only needs its width and spread angle carried along the path, where differentials would need 4 extra vectors per ray
+Every bounce is treated like a mirror, so the cone keeps its spread, which blurs rough surfaces less than it could but never too much
+Returns log2 of the footprint in texture coordinates, which is what Texture2D::Sample takes
+*/
+float TextureFootprint(float uvAreaRatio, float coneWidth, float cosine) {
+    if (uvAreaRatio <= 0.0f || coneWidth <= 0.0f || cosine <= 0.0f)
+        return -INFINITY;
+    return 0.5f * log2(uvAreaRatio) + log2(coneWidth / cosine);
+}
+
+/*
+Shading shared by PathTraceImage and PathTraceWavefront, which only differ in the order they do things in
+Each helper draws its random numbers in the same order no matter who calls it, which is what lets both integrators trace exactly the same rays
+*/
+
+// Radiance picked up by hitting an emitter, MIS weighted against the light sample of the previous vertex
+// brdfPdf is the solid angle pdf of the BRDF sample that led here, 0 for the camera ray since there is no other way to reach what it sees
+vec3 EmittedRadiance(
+    const HitInfo& closest, const Ray& ray, float brdfPdf, vec3 lastPosition, const LightSelection& lights,
+    ArrayView<MaterialInstance> materials, float totalLightArea, const Distribution2D& environment, const TextureCubemap* skybox
+) {
+    if (closest.intersection.matId == 0) {
+        // The skybox is only reached through the BRDF, while the sun could also have been picked as a light
+        vec3 emission = skybox->Sample(ray.direction);
+        if (brdfPdf > 0.0f && lights.environment > 0.0f)
+            emission *= BalanceHeuristic(brdfPdf, lights.environment * EnvironmentPdf(environment, ray.direction));
+        if (dot(ray.direction, sunDir) > sunMaxDot) {
+            float weight = (brdfPdf > 0.0f ? BalanceHeuristic(brdfPdf, lights.sun * SunConePdf()) : 1.0f);
+            emission += weight * materials[0].emission;
+        }
+        return emission;
+    }
+
+    float weight = 1.0f;
+    if (brdfPdf > 0.0f) {
+        float lightDistance = distance(lastPosition, closest.intersection.position);
+        float cosine = abs(dot(closest.intersection.normal, ray.direction));
+        float lightPdf = lights.triangles * lightDistance * lightDistance / max(cosine * totalLightArea, 1e-20f);
+        weight = BalanceHeuristic(brdfPdf, lightPdf);
+    }
+    return weight * materials[closest.intersection.matId].emission;
+}
+
+// Everything about a surface hit that the light sample and the BRDF sample need
+struct ShadingPoint {
+    vec3 normal;
+    vec3 position; // Already offset along the normal for the rays leaving it
+    vec3 viewDir;
+    mat3 tbn;
+    vec3 albedo;
+    float roughness, metalness;
+    float diffuseProbability;
+};
+
+// albedo and data are the lookups into the two textures of the material
+ShadingPoint MakeShadingPoint(const HitInfo& closest, const Ray& ray, vec3 albedo, vec3 data) {
+    ShadingPoint surface;
+    surface.normal = closest.intersection.normal;
+    surface.position = closest.intersection.position + surface.normal * kShadowRayOffset;
+    surface.viewDir = -ray.direction;
+
+    vec3 normcrs = (abs(surface.normal.y) > 0.99 ? vec3(1.0, 0.0, 0.0) : vec3(0.0, 1.0, 0.0));
+    vec3 tangent = normalize(cross(normcrs, surface.normal));
+    vec3 bitangent = cross(tangent, surface.normal);
+    surface.tbn = mat3(tangent, bitangent, surface.normal);
+
+    surface.albedo = albedo;
+    surface.roughness = data.g * data.g;
+    surface.metalness = data.b;
+    surface.diffuseProbability = DiffuseLobeProbability(albedo, surface.metalness);
+    return surface;
+}
+
+// Light sample whose contribution only counts if nothing is in the way
+struct LightConnection {
+    Ray ray;
+    float distance;
+    vec3 contribution; // Includes the throughput and the MIS weight
+};
+
+// Returns false when the light sample cannot contribute at all, in which case there is no shadow ray to trace
+template<typename Sampler>
+bool ConnectToLight(
+    const ShadingPoint& surface, vec3 throughput, Sampler& random, LightConnection& connection, const LightSelection& lights,
+    ArrayView<CompactTriangle> triangles, ArrayView<MaterialInstance> materials, ArrayView<LightTriangleInfo> emitters, float totalLightArea,
+    const Distribution2D& environment, const TextureCubemap* skybox
+) {
+    random.StartBounce();
+    float lightPick = random.Next();
+    float lightU0 = random.Next(), lightU1 = random.Next();
+    LightSample light = SampleLight(lights, surface.position, lightPick, lightU0, lightU1, triangles, materials, emitters, totalLightArea, environment, skybox);
+
+    float ndl = dot(surface.normal, light.direction);
+    if (light.pdf <= 0.0f || ndl <= 0.0f)
+        return false;
+
+    vec3 brdf = GGXCookTorrance(surface.albedo, surface.roughness, surface.metalness, surface.normal, surface.viewDir, light.direction);
+    if (brdf == vec3(0.0f))
+        return false;
+
+    connection.ray.origin = surface.position;
+    connection.ray.direction = light.direction;
+    connection.distance = light.distance;
+    float weight = BalanceHeuristic(light.pdf, BRDFDirectionPdf(surface.normal, surface.viewDir, light.direction, surface.roughness, surface.diffuseProbability));
+    connection.contribution = throughput * brdf * ndl * light.emission * weight / light.pdf;
+    return true;
+}
+
+// Anything closer than the light blocks it
+bool IsUnoccluded(const LightConnection& connection, ArrayView<CompactTriangle> triangles, ArrayView<NodeSerialized> nodes, ArrayView<int32_t> references) {
+    HitInfo occluder;
+    occluder.depth = connection.distance * (1.0f - 1e-4f) - kShadowRayOffset;
+    return !TraverseBVH(connection.ray, occluder, triangles, nodes, references);
+}
+
+// BRDF sample to continue the path, followed by russian roulette. Returns false when the path ends here
+template<typename Sampler>
+bool ContinuePath(const ShadingPoint& surface, Sampler& random, Ray& ray, vec3& throughput, float& brdfPdf, vec3& lastPosition) {
+    random.StartBounce();
+    float lobe = random.Next();
+    float brdfU0 = random.Next(), brdfU1 = random.Next();
+    ray.origin = surface.position;
+    ray.direction = SampleBRDFDirection(surface.tbn, surface.viewDir, surface.roughness, surface.diffuseProbability, lobe, brdfU0, brdfU1);
+
+    brdfPdf = BRDFDirectionPdf(surface.normal, surface.viewDir, ray.direction, surface.roughness, surface.diffuseProbability);
+    if (brdfPdf <= 0.0f)
+        return false;
+
+    throughput *= GGXCookTorrance(surface.albedo, surface.roughness, surface.metalness, surface.normal, surface.viewDir, ray.direction) * dot(surface.normal, ray.direction) / brdfPdf;
+    lastPosition = surface.position;
+
+    float rr = min(max(throughput.x, max(throughput.y, throughput.z)), 1.0f);
+    if (random.Next() > rr)
+        return false;
+    throughput /= rr;
+    return true;
+}
+
+// Traces samples [firstSample, firstSample + numSamples) of a pixel, both of which have to be multiples of kRandomLanes
+void PathTraceImage(
+    PixelEstimate& estimate, uint32_t x, uint32_t y, uint32_t firstSample, uint32_t numSamples, const uint32_t w, const uint32_t h, const Camera& camera,
+    ArrayView<CompactTriangle> triangles, ArrayView<NodeSerialized> nodes, ArrayView<int32_t> references,
+    ArrayView<MaterialInstance> materials, ArrayView<Texture*> textures, ArrayView<LightTriangleInfo> emitters, float totalLightArea,
+    const Distribution2D& environment
+) {
+    const TextureCubemap* skybox = (const TextureCubemap*)textures.front();
+    LightSelection lights = SelectLights(emitters, environment);
+    float spreadAngle = camera.GetPixelSpreadAngle(h);
+
+    uint32_t pixelIndex = y * w + x;
+#ifndef OWEN_SOBOL_REFERENCE
+    RandomStreams8 streams(kReferenceRandomGenerator, pixelIndex);
+    streams.SkipTo(firstSample);
+    alignas(32) float block[kRandomLanes * kRandomBlockDimensions];
+#endif
+    for (uint32_t i = firstSample; i < firstSample + numSamples; i += kRandomLanes) {
+#ifndef OWEN_SOBOL_REFERENCE
+        streams.Fill(block, 0, kRandomBlockDimensions);
+#endif
+        for (uint32_t lane = 0; lane < kRandomLanes; lane++) {
+#ifdef OWEN_SOBOL_REFERENCE
+            SobolSampler random(pixelIndex, i + lane);
+#else
+            LaneSampler random(streams, block, lane);
+#endif
+            vec2 interpolation = vec2(x + random.Next(), y + random.Next()) / vec2(w, h);
+            Ray ray = camera.GenRay(interpolation, random.Next(), random.Next());
+            vec3 throughput = vec3(1.0);
+            vec3 radiance = vec3(0.0);
+
+            // Solid angle pdf of the BRDF sample that led to the current vertex, 0 for the camera ray since there is no other way to reach what it sees
+            float brdfPdf = 0.0f;
+            vec3 lastPosition = ray.origin;
+            float coneWidth = 0.0f;
+
+            while(true) {
+                HitInfo closest;
+
+                TraverseBVH(ray, closest, triangles, nodes, references);
+                closest.intersection.matId /= 2; // Not needed for the CPU
+                coneWidth += spreadAngle * closest.depth;
+
+                if (materials[closest.intersection.matId].isEmissive) {
+                    radiance += throughput * EmittedRadiance(closest, ray, brdfPdf, lastPosition, lights, materials, totalLightArea, environment, skybox);
+                    break;
+                }
+
+                const Texture2D* tex = (const Texture2D*)textures[2ULL * closest.intersection.matId - 1ULL];
+                const Texture2D* mat = (const Texture2D*)textures[2ULL * closest.intersection.matId];
+                float footprint = TextureFootprint(closest.uvAreaRatio, coneWidth, abs(dot(closest.intersection.normal, ray.direction)));
+                ShadingPoint surface = MakeShadingPoint(closest, ray, tex->Sample(closest.intersection.texcoord, footprint), mat->Sample(closest.intersection.texcoord, footprint));
+
+                LightConnection connection;
+                if (ConnectToLight(surface, throughput, random, connection, lights, triangles, materials, emitters, totalLightArea, environment, skybox) && IsUnoccluded(connection, triangles, nodes, references))
+                    radiance += connection.contribution;
+
+                if (!ContinuePath(surface, random, ray, throughput, brdfPdf, lastPosition))
+                    break;
+            }
+
+            estimate.AddSample(radiance);
+        }
+#ifndef OWEN_SOBOL_REFERENCE
+        streams.NextSamples();
+#endif
+    }
+}
+
+
+/*
+Wavefront version of PathTraceImage [Laine et al. 2013], for a batch of pixels at once
+Instead of following one path from the camera to its end, a wave of up to kWavefrontMaxPaths paths goes through each stage together:
+trace every extension ray, sort the paths by the material they hit, shade them one material at a time, trace every shadow ray,
+and then compact the paths that are still alive so that the next bounce only touches those
+Shading one material at a time means the same two textures and the same branch of the BRDF stay in cache for the whole run,
+and traversal only ever sees an array of rays, which is where a packet traversal would go
+Paths always use Owen scrambled Sobol with the same dimensions as PathTraceImage, so with OWEN_SOBOL_REFERENCE both trace exactly the same rays
+*/
+//#define WAVEFRONT_REFERENCE // Trace the reference with PathTraceWavefront instead of PathTraceImage
+#if defined(WAVEFRONT_REFERENCE) && !defined(OWEN_SOBOL_REFERENCE)
+// The checkpoint key and the random streams of PathTraceImage would describe a different render than the one the wavefront traces
+#error "WAVEFRONT_REFERENCE needs OWEN_SOBOL_REFERENCE, the wavefront integrator only draws from Owen scrambled Sobol"
+#endif
+constexpr uint32_t kWavefrontMaxPaths = 4096;
+constexpr uint32_t kWavefrontTaskPixels = 16; // Pixels a render thread takes at once, each with all of the samples it needs this round
+
+struct WavefrontPixel {
+    uint32_t x, y;
+    uint32_t firstSample;
+    uint32_t numSamples;
+    PixelEstimate* estimate;
+};
+
+struct WavefrontPath {
+    Ray ray;
+    vec3 throughput;
+    vec3 radiance;
+    vec3 lastPosition;
+    float brdfPdf;
+    float coneWidth;
+    SobolSampler random;
+    uint32_t pixel; // Index into the batch
+};
+
+struct WavefrontShadowRay {
+    LightConnection connection;
+    uint32_t path;
+};
+
+// Traces samples [firstSample, firstSample + numSamples) of every pixel in the batch, which have to be multiples of kRandomLanes like PathTraceImage. Returns the number of rays traced
+uint64_t PathTraceWavefront(
+    const std::vector<WavefrontPixel>& pixels, const uint32_t w, const uint32_t h, const Camera& camera,
+    ArrayView<CompactTriangle> triangles, ArrayView<NodeSerialized> nodes, ArrayView<int32_t> references,
+    ArrayView<MaterialInstance> materials, ArrayView<Texture*> textures, ArrayView<LightTriangleInfo> emitters, float totalLightArea,
+    const Distribution2D& environment
+) {
+    const TextureCubemap* skybox = (const TextureCubemap*)textures.front();
+    LightSelection lights = SelectLights(emitters, environment);
+    float spreadAngle = camera.GetPixelSpreadAngle(h);
+    uint64_t numRays = 0;
+
+    std::vector<WavefrontPath> paths, sortedPaths;
+    std::vector<HitInfo> hits, sortedHits;
+    std::vector<uint32_t> materialOffsets(materials.size() + 1);
+    std::vector<uint32_t> materialCursors(materials.size());
+    std::vector<WavefrontShadowRay> shadowRays;
+    std::vector<uint8_t> alive;
+    // Texture lookups of a material run, gathered so that they go through Texture2D::SampleMany together
+    std::vector<vec2> runTexcoords;
+    std::vector<float> runFootprints;
+    std::vector<vec3> runAlbedos, runData;
+    paths.reserve(kWavefrontMaxPaths);
+
+    size_t nextPixel = 0;
+    uint32_t nextSample = (pixels.empty() ? 0 : pixels.front().firstSample);
+    while (nextPixel < pixels.size()) {
+        // Generate camera rays until the wave is full, moving on to the next pixel once all of the samples of one are out
+        paths.clear();
+        while (paths.size() < kWavefrontMaxPaths && nextPixel < pixels.size()) {
+            const WavefrontPixel& pixel = pixels[nextPixel];
+            if (nextSample >= pixel.firstSample + pixel.numSamples) {
+                if (++nextPixel < pixels.size())
+                    nextSample = pixels[nextPixel].firstSample;
+                continue;
+            }
+
+            WavefrontPath path{ Ray(), vec3(1.0f), vec3(0.0f), vec3(0.0f), 0.0f, 0.0f, SobolSampler(pixel.y * w + pixel.x, nextSample++), (uint32_t)nextPixel };
+            vec2 interpolation = vec2(pixel.x + path.random.Next(), pixel.y + path.random.Next()) / vec2(w, h);
+            path.ray = camera.GenRay(interpolation, path.random.Next(), path.random.Next());
+            path.lastPosition = path.ray.origin;
+            paths.push_back(path);
+        }
+
+        while (!paths.empty()) {
+            // Extend
+            hits.assign(paths.size(), HitInfo());
+            for (size_t i = 0; i < paths.size(); i++) {
+                TraverseBVH(paths[i].ray, hits[i], triangles, nodes, references);
+                hits[i].intersection.matId /= 2; // Not needed for the CPU
+                paths[i].coneWidth += spreadAngle * hits[i].depth;
+            }
+            numRays += paths.size();
+
+            // Counting sort by material, moving the paths themselves so that shading walks through memory in order
+            std::fill(materialOffsets.begin(), materialOffsets.end(), 0);
+            for (const HitInfo& hit : hits)
+                materialOffsets[hit.intersection.matId + 1]++;
+            for (size_t m = 0; m < materials.size(); m++) {
+                materialOffsets[m + 1] += materialOffsets[m];
+                materialCursors[m] = materialOffsets[m];
+            }
+
+            sortedPaths.resize(paths.size());
+            sortedHits.resize(hits.size());
+            for (size_t i = 0; i < paths.size(); i++) {
+                uint32_t destination = materialCursors[hits[i].intersection.matId]++;
+                sortedPaths[destination] = paths[i];
+                sortedHits[destination] = hits[i];
+            }
+            std::swap(paths, sortedPaths);
+            std::swap(hits, sortedHits);
+
+            // Shade
+            shadowRays.clear();
+            alive.assign(paths.size(), 0);
+            for (size_t m = 0; m < materials.size(); m++) {
+                uint32_t begin = materialOffsets[m], end = materialOffsets[m + 1];
+                if (begin == end)
+                    continue;
+
+                if (materials[m].isEmissive) {
+                    for (uint32_t i = begin; i < end; i++)
+                        paths[i].radiance += paths[i].throughput * EmittedRadiance(hits[i], paths[i].ray, paths[i].brdfPdf, paths[i].lastPosition, lights, materials, totalLightArea, environment, skybox);
+                    continue;
+                }
+
+                const Texture2D* tex = (const Texture2D*)textures[2ULL * m - 1ULL];
+                const Texture2D* mat = (const Texture2D*)textures[2ULL * m];
+
+                runTexcoords.resize(end - begin);
+                runFootprints.resize(end - begin);
+                runAlbedos.resize(end - begin);
+                runData.resize(end - begin);
+                for (uint32_t i = begin; i < end; i++) {
+                    const HitInfo& closest = hits[i];
+                    runTexcoords[i - begin] = closest.intersection.texcoord;
+                    runFootprints[i - begin] = TextureFootprint(closest.uvAreaRatio, paths[i].coneWidth, abs(dot(closest.intersection.normal, paths[i].ray.direction)));
+                }
+                tex->SampleMany(end - begin, runTexcoords.data(), runFootprints.data(), runAlbedos.data());
+                mat->SampleMany(end - begin, runTexcoords.data(), runFootprints.data(), runData.data());
+
+                for (uint32_t i = begin; i < end; i++) {
+                    WavefrontPath& path = paths[i];
+                    ShadingPoint surface = MakeShadingPoint(hits[i], path.ray, runAlbedos[i - begin], runData[i - begin]);
+
+                    // Light sample, traced with the rest of the wave once shading is done
+                    WavefrontShadowRay shadow;
+                    shadow.path = i;
+                    if (ConnectToLight(surface, path.throughput, path.random, shadow.connection, lights, triangles, materials, emitters, totalLightArea, environment, skybox))
+                        shadowRays.push_back(shadow);
+
+                    alive[i] = ContinuePath(surface, path.random, path.ray, path.throughput, path.brdfPdf, path.lastPosition);
+                }
+            }
+
+            // Shadow rays
+            for (const WavefrontShadowRay& shadow : shadowRays) {
+                if (IsUnoccluded(shadow.connection, triangles, nodes, references))
+                    paths[shadow.path].radiance += shadow.connection.contribution;
+            }
+            numRays += shadowRays.size();
+
+            // Finished paths go to their pixel, and the rest are compacted for the next bounce
+            size_t numAlive = 0;
+            for (size_t i = 0; i < paths.size(); i++) {
+                if (alive[i])
+                    paths[numAlive++] = paths[i];
+                else
+                    pixels[paths[i].pixel].estimate->AddSample(paths[i].radiance);
+            }
+            paths.resize(numAlive);
+        }
+    }
+
+    return numRays;
+}
+
+
+// Render the ground truth of the image on the CPU
+void Renderer::RenderReference(const Camera& camera) {
+    TestGoldenRatio();
+    auto filename = std::to_string(std::time(nullptr));
+    SaveScreenshot("res/screenshots/" + filename + '-' + std::to_string(numSamples) + "-RENDERED.png");
+    // Nothing services the captures until the reference is done, so this one has to be off the GPU before we start
+    ServiceCaptures(0);
+
+    uint64_t numPixels = (uint64_t) viewportWidth * viewportHeight;
+    uint8_t* image = new uint8_t[3ULL * numPixels];
+
+    // Every pixel starts with the same number of samples, and then gets more in rounds until it converges
+    std::vector<PixelEstimate> estimates(numPixels);
+    std::vector<uint32_t> targetSamples(numPixels, kAdaptiveInitialSamples);
+
+    // The background build publishes the refined BVH for the CPU before its future is ready, so after this the hierarchy hash
+    // is the same no matter how far along the build was when the render started, and every pixel is traced against the final tree
+    if (scene.refinedBvh.valid())
+        scene.refinedBvh.wait();
+
+    ReferenceRenderKey checkpointKey;
+    memset(&checkpointKey, 0, sizeof(checkpointKey));
+    checkpointKey.version = kReferenceCheckpointVersion;
+    checkpointKey.width = viewportWidth;
+    checkpointKey.height = viewportHeight;
+    checkpointKey.maxSamples = KNumRefSamples;
+    checkpointKey.initialSamples = kAdaptiveInitialSamples;
+    checkpointKey.relativeError = kAdaptiveRelativeError;
+#ifdef OWEN_SOBOL_REFERENCE
+    checkpointKey.sampler = UINT32_MAX;
+#else
+    checkpointKey.sampler = (uint32_t)kReferenceRandomGenerator;
+#endif
+    checkpointKey.numTriangles = (uint32_t)scene.triangleVec.size();
+    checkpointKey.numEmitters = (uint32_t)scene.emitterVec.size();
+    checkpointKey.cameraPosition = camera.position;
+    checkpointKey.cameraDirection = camera.direction;
+    checkpointKey.aspect = camera.aspect_ratio;
+    checkpointKey.fov = camera.fov;
+    checkpointKey.focalDistance = camera.focal_distance;
+    checkpointKey.lensRadius = camera.lens_radius;
+    checkpointKey.sunDirection = sunDir;
+    checkpointKey.sunRadius = sunRadius;
+    checkpointKey.sunMaxDot = sunMaxDot;
+    checkpointKey.hierarchyHash = std::atomic_load(&scene.cpuBvh)->ComputeHash();
+    checkpointKey.geometryHash = HashGeometry(scene.triangleVec);
+    checkpointKey.materialHash = HashMaterials(scene.materialVec);
+    checkpointKey.environmentHash = ((const TextureCubemap*)scene.textures.front())->ComputeHash();
+
+    ReferenceRenderProgress progress;
+    progress.round = 0;
+    progress.startTime = std::time(nullptr);
+    progress.elapsedTime = 0;
+    if (LoadReferenceCheckpoint(checkpointKey, progress, estimates, targetSamples)) {
+        std::cout << "Resuming the reference render from round " << progress.round << " after " << progress.elapsedTime << " seconds\n";
+        filename = std::to_string(progress.startTime);
+    }
+
+    for (uint32_t y = 0; y < viewportHeight; y++) {
+        for (uint32_t x = 0; x < viewportWidth; x++) {
+            size_t idx = (size_t)y * viewportWidth + x;
+            if (estimates[idx].numSamples > 0) {
+                WriteReferencePixel(image, x, y, viewportWidth, estimates[idx].mean);
+            }
+            else {
+                image[3 * idx] = 0;
+                image[3 * idx + 1] = 0;
+                image[3 * idx + 2] = 0;
+            }
+        }
+    }
+
+    Texture2D pixels;
+    pixels.CreateBinding();
+    pixels.LoadData(GL_RGB, GL_RGB, GL_UNSIGNED_BYTE, viewportWidth, viewportHeight, image);
+    pixels.BindTextureUnit(15, GL_TEXTURE_2D);
+
+    //glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGB, viewportWidth, viewportHeight);
+
+    ShaderRasterization imagePresent;
+    imagePresent.CompileFiles("extra/Image.vert", "extra/Image.frag");
+    imagePresent.CreateBinding();
+    imagePresent.LoadInteger("image", 15);
+
+    // Time spent before the checkpoint counts towards the budget and the reported render time
+    auto start = std::time(nullptr) - progress.elapsedTime;
+    // The progress thread reads these while the main thread and the workers move them along, so they are all atomic
+    std::atomic<time_t> roundStart(start);
+    std::atomic<uint32_t> round(progress.round);
+    std::atomic<size_t> roundSize(0);
+    // Workers grab tasks by bumping this, so it can end up past the end of pixelTasks by a few tasks per worker
+    std::atomic<uint32_t> nextTask(0);
+    std::vector<ivec2> pixelTasks;
+
+    // Workers trace into their own copy of an estimate and only take this lock to store it, so that a checkpoint never sees half of a pixel's samples
+    std::mutex estimateMutex;
+
+    // Rewritten after every round so that a usable image is on disk long before the render is done
+    std::string hdrPath = "res/screenshots/" + filename + "-REFERENCE" + GetHDRExtension(kReferenceHDRFormat);
+    auto gatherRadiance = [&]() {
+        std::vector<vec3> radiance(numPixels);
+        for (size_t i = 0; i < numPixels; i++)
+            radiance[i] = estimates[i].mean;
+        return radiance;
+    };
+
+    Timer checkpointTimer;
+    checkpointTimer.Begin();
+    auto checkpoint = [&]() {
+        progress.round = round;
+        progress.elapsedTime = std::time(nullptr) - start;
+
+        estimateMutex.lock();
+        std::vector<PixelEstimate> estimatesCopy = estimates;
+        estimateMutex.unlock();
+
+        SaveReferenceCheckpoint(checkpointKey, progress, estimatesCopy, targetSamples);
+        checkpointTimer.Begin();
+    };
+
+    std::atomic<bool> renderInProgress(true);
+    std::thread progressUpdateThread([&renderInProgress](std::atomic<time_t>& roundStart, std::atomic<uint32_t>& round, std::atomic<uint32_t>& nextTask, std::atomic<size_t>& roundSize) {
+            while (renderInProgress) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+
+                // Nothing to report until the first round has handed out a task
+                size_t size = roundSize;
+                size_t done = std::min<size_t>(nextTask, size);
+                if (size == 0 || done == 0)
+                    continue;
+
+                std::cout << "Round " << round << ": rendering " << 100.0f * done / size << "% of " << size << " pixels complete\tTime remaining: " << (std::time(nullptr) - roundStart) * ((float)size - done) / done << " seconds\n";
+            }
+        }, std::ref(roundStart), std::ref(round), std::ref(nextTask), std::ref(roundSize)
+    );
+
+    while (true) {
+        pixelTasks.clear();
+        for (uint32_t y = 0; y < viewportHeight; y++) {
+            for (uint32_t x = 0; x < viewportWidth; x++) {
+                size_t idx = (size_t)y * viewportWidth + x;
+                if (targetSamples[idx] > estimates[idx].numSamples)
+                    pixelTasks.emplace_back(x, y);
+            }
+        }
+
+        if (pixelTasks.empty())
+            break;
+
+        roundStart = std::time(nullptr);
+        roundSize = pixelTasks.size();
+        nextTask = 0;
+
+        std::vector<std::thread> workers;
+        for (uint32_t i = 0; i < kNumWorkers; i++) {
+            workers.emplace_back(
+                [](
+                std::atomic<uint32_t>& nextTask, std::mutex& estimateMutex, uint8_t* image, std::vector<PixelEstimate>& estimates, const std::vector<uint32_t>& targetSamples, const std::vector<ivec2>& pixelTasks, uint32_t w, uint32_t h, const Camera& camera,
+                    const std::vector<CompactTriangle>& triangles, const std::shared_ptr<const BoundingVolumeHierarchy>& hierarchy,
+                    const std::vector<MaterialInstance>& materials, const std::vector<Texture*>& textures, const std::vector<LightTriangleInfo>& emitters, float totalLightArea,
+                    const Distribution2D& environment
+                ) {
+#ifdef WAVEFRONT_REFERENCE
+                    std::vector<PixelEstimate> batchEstimates;
+                    std::vector<WavefrontPixel> batch;
+                    while (true) {
+                        uint32_t firstTask = nextTask.fetch_add(kWavefrontTaskPixels);
+                        if (firstTask >= pixelTasks.size())
+                            return;
+                        uint32_t lastTask = std::min(firstTask + kWavefrontTaskPixels, (uint32_t)pixelTasks.size());
+
+                        // Reserved up front so that the pointers in the batch stay valid
+                        batchEstimates.clear();
+                        batchEstimates.reserve(lastTask - firstTask);
+                        batch.clear();
+                        for (uint32_t task = firstTask; task < lastTask; task++) {
+                            ivec2 pixel = pixelTasks[task];
+                            size_t pixelIndex = (size_t)pixel.y * w + pixel.x;
+                            batchEstimates.push_back(estimates[pixelIndex]);
+                            PixelEstimate& estimate = batchEstimates.back();
+                            batch.push_back({ (uint32_t)pixel.x, (uint32_t)pixel.y, estimate.numSamples, targetSamples[pixelIndex] - estimate.numSamples, &estimate });
+                        }
+
+                        // Keep our own reference so that a BVH swap cannot free it until this task is done
+                        auto bvh = std::atomic_load(&hierarchy);
+                        PathTraceWavefront(batch, w, h, camera, triangles, bvh->nodesVec, bvh->referenceVec, materials, textures, emitters, totalLightArea, environment);
+
+                        estimateMutex.lock();
+                        for (const WavefrontPixel& pixel : batch) {
+                            WriteReferencePixel(image, pixel.x, pixel.y, w, pixel.estimate->mean);
+                            estimates[(size_t)pixel.y * w + pixel.x] = *pixel.estimate;
+                        }
+                        estimateMutex.unlock();
+                    }
+#else
+                    while (true) {
+                        uint32_t currentTask = nextTask++;
+
+                        if (currentTask >= pixelTasks.size())
+                            return;
+
+                        ivec2 pixel = pixelTasks[currentTask];
+                        size_t pixelIndex = (size_t)pixel.y * w + pixel.x;
+                        PixelEstimate estimate = estimates[pixelIndex];
+                        uint32_t target = targetSamples[pixelIndex];
+
+                        // Keep our own reference so that a BVH swap cannot free it until this task is done
+                        auto bvh = std::atomic_load(&hierarchy);
+                        PathTraceImage(estimate, pixel.x, pixel.y, estimate.numSamples, target - estimate.numSamples, w, h, camera, triangles, bvh->nodesVec, bvh->referenceVec, materials, textures, emitters, totalLightArea, environment);
+                        WriteReferencePixel(image, pixel.x, pixel.y, w, estimate.mean);
+
+                        estimateMutex.lock();
+                        estimates[pixelIndex] = estimate;
+                        estimateMutex.unlock();
+                    }
+#endif
+                },
+                std::ref(nextTask), std::ref(estimateMutex), image, std::ref(estimates), std::cref(targetSamples), std::cref(pixelTasks), viewportWidth, viewportHeight, std::ref(camera), std::ref(scene.triangleVec), std::cref(scene.cpuBvh), std::ref(scene.materialVec), std::ref(scene.textures), std::ref(scene.emitterVec), scene.totalLightArea, std::cref(scene.environmentDistribution)
+            );
+        }
+
+        while (nextTask < pixelTasks.size()) {
+            glClear(GL_COLOR_BUFFER_BIT);
+            //glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewportWidth, viewportHeight, GL_RGB, GL_UNSIGNED_BYTE, image);
+            pixels.LoadData(GL_RGB, GL_RGB, GL_UNSIGNED_BYTE, viewportWidth, viewportHeight, image);
+
+            glDrawArrays(GL_TRIANGLES, 0, 6);
+            bindedWindow->Update();
+
+            checkpointTimer.End();
+            if (checkpointTimer.Delta >= kReferenceCheckpointInterval)
+                checkpoint();
+        }
+
+        for (std::thread& worker : workers)
+            worker.join();
+
+        // Plan the next round, pixels that converged or hit KNumRefSamples get a target of 0
+        size_t numRemaining = 0;
+        for (size_t i = 0; i < numPixels; i++) {
+            targetSamples[i] = estimates[i].NextSampleCount();
+            numRemaining += (targetSamples[i] != 0);
+        }
+        std::cout << "Round " << round << " done, " << numRemaining << " pixels have not converged yet\n";
+        round++;
+        checkpoint();
+
+        // The writer works on its own copy, so we can start on the next round right away
+        imageWriter.WriteHDR(hdrPath, viewportWidth, viewportHeight, gatherRadiance(), kReferenceHDRFormat);
+
+        if (kAdaptiveTimeBudget > 0.0 && std::time(nullptr) - start >= kAdaptiveTimeBudget) {
+            std::cout << "Out of time, stopping with " << numRemaining << " pixels left\n";
+            break;
+        }
+    }
+
+    imagePresent.Free();
+    pixels.Free();
+
+    renderInProgress = false;
+    progressUpdateThread.join();
+
+    uint64_t totalSamples = 0;
+    float worstError = 0.0f;
+    for (const PixelEstimate& estimate : estimates) {
+        totalSamples += estimate.numSamples;
+        worstError = max(worstError, estimate.RelativeError());
+    }
+    std::cout << "Traced " << (double)totalSamples / numPixels << " samples per pixel on average, " << (double)KNumRefSamples * numPixels / totalSamples << "x fewer than a uniform " << KNumRefSamples << " samples per pixel. Worst relative error: " << worstError << '\n';
+    auto deltaT = std::time(nullptr) - start;
+
+    std::vector<vec3> radiance = gatherRadiance();
+    WriteCapture("res/screenshots/" + filename + '-' + std::to_string(deltaT) + "-REFERENCE.png", CaptureFormat::PNG, viewportWidth, viewportHeight, radiance, 1.0f);
+    imageWriter.WriteHDR(hdrPath, viewportWidth, viewportHeight, std::move(radiance), kReferenceHDRFormat);
+
+    delete[] image;
+
+    // Nothing is left to resume once the output is on disk. Rendering is over by now, so waiting for the writer costs nothing
+    imageWriter.Flush();
+    std::error_code removeError;
+    std::filesystem::remove(kReferenceCheckpointPath, removeError);
+
+    std::cout << "Pssst? You still there? Rendering completed in " << deltaT << " seconds\n";
+}
+
+/*
+Distributed reference renderer
+The coordinator writes everything the CPU path tracer needs into one cache file and launches worker processes that map it read only,
+so the scene is in memory once no matter how many workers there are. The workers connect back over TCP and get one job at a time,
+a tile plus a range of sample indices, and send back the mean radiance of those samples for every pixel of the tile
+Every sample is keyed by its pixel and index, so merging the tiles gives the same image a single process would have rendered
+A worker that crashes or gets killed closes its connection, and whatever job it was on goes back into the queue for the others
+Everything runs on this machine for now, but the workers only need the cache file and an address to connect to
+Unlike RenderReference, every pixel gets KNumRefSamples since the adaptive rounds would need the estimates of the whole image in one place
+*/
+constexpr const char* kDistributedScenePath = "cache/DistributedScene.BIN";
+constexpr const char* kDistributedAddress = "127.0.0.1";
+constexpr uint32_t kDistributedMagic = 0x54445044; // "DPDT"
+constexpr uint32_t kDistributedVersion = 3;
+constexpr uint32_t kNumDistributedWorkers = kNumWorkers;
+constexpr uint32_t kDistributedTileSize = 32;
+constexpr uint32_t kDistributedJobSamples = 1024; // Around a second per tile, short enough that a dead worker does not cost much
+constexpr double kDistributedConnectTimeout = 30.0; // Seconds to wait for each worker to start up and connect
+constexpr uint64_t kDistributedSectionAlignment = 64;
+
+static_assert(kDistributedJobSamples % kRandomLanes == 0 && KNumRefSamples % kDistributedJobSamples == 0, "Jobs have to split the samples into whole batches of lanes");
+static_assert(std::is_trivially_copyable<Camera>::value, "The camera is copied into the scene cache as is");
+
+struct DistributedSection {
+    uint64_t offset;
+    uint64_t count;
+};
+
+/*
+The cache is this header followed by each section, aligned to kDistributedSectionAlignment so that the workers can use them in place
+Images are the 6 faces of the skybox followed by the 2D textures in the order of Scene::textures, so texture i > 0 is image i + 5
+*/
+struct DistributedSceneHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint8_t camera[sizeof(Camera)];
+    float totalLightArea;
+    DistributedSection triangles;
+    DistributedSection nodes;
+    DistributedSection references;
+    DistributedSection materials;
+    DistributedSection emitters;
+    DistributedSection images;
+};
+
+struct DistributedImage {
+    TexelFormat format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t padding;
+    uint64_t offset;
+};
+
+// First thing a worker sends after it connects
+struct DistributedHello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t processId;
+};
+
+// The worker sends the job back in front of the tile, so that the coordinator can tell the tile is the one it asked for. A width of 0 tells the worker to quit
+struct DistributedJob {
+    uint32_t x, y;
+    uint32_t width, height;
+    uint32_t firstSample;
+    uint32_t numSamples;
+};
+
+uint64_t GetDistributedImageSize(const DistributedImage& image) {
+    // Texels are written exactly the way Texture2D keeps them, mip chain and all, so that workers can sample straight out of the mapping
+    Texture2D layout;
+    layout.ViewData(image.format, image.width, image.height, nullptr);
+    return layout.GetStorageSize();
+}
+
+bool Renderer::SaveDistributedScene(const std::string& path, const Camera& camera) {
+    std::error_code error;
+    std::filesystem::create_directories(path.substr(0, path.rfind('/')), error);
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+
+    auto bvh = std::atomic_load(&scene.cpuBvh);
+
+    std::vector<const Texture2D*> planes;
+    const TextureCubemap* skybox = (const TextureCubemap*)scene.textures.front();
+    for (const Texture2D& face : skybox->faces)
+        planes.push_back(&face);
+    for (size_t i = 1; i < scene.textures.size(); i++)
+        planes.push_back((const Texture2D*)scene.textures[i]);
+
+    DistributedSceneHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kDistributedMagic;
+    header.version = kDistributedVersion;
+    header.width = viewportWidth;
+    header.height = viewportHeight;
+    memcpy(header.camera, &camera, sizeof(Camera));
+    header.totalLightArea = scene.totalLightArea;
+
+    bool written = (fwrite(&header, sizeof(header), 1, file) == 1);
+    uint64_t position = sizeof(header);
+    auto writeSection = [&](const void* data, uint64_t size) {
+        static const uint8_t zeros[kDistributedSectionAlignment] = {};
+        uint64_t padding = (kDistributedSectionAlignment - position % kDistributedSectionAlignment) % kDistributedSectionAlignment;
+        written &= (fwrite(zeros, 1, padding, file) == padding);
+        written &= (fwrite(data, 1, size, file) == size);
+
+        uint64_t offset = position + padding;
+        position = offset + size;
+        return offset;
+    };
+
+    header.triangles = { writeSection(scene.triangleVec.data(), scene.triangleVec.size() * sizeof(CompactTriangle)), scene.triangleVec.size() };
+    header.nodes = { writeSection(bvh->nodesVec.data(), bvh->nodesVec.size() * sizeof(NodeSerialized)), bvh->nodesVec.size() };
+    header.references = { writeSection(bvh->referenceVec.data(), bvh->referenceVec.size() * sizeof(int32_t)), bvh->referenceVec.size() };
+    header.materials = { writeSection(scene.materialVec.data(), scene.materialVec.size() * sizeof(MaterialInstance)), scene.materialVec.size() };
+    header.emitters = { writeSection(scene.emitterVec.data(), scene.emitterVec.size() * sizeof(LightTriangleInfo)), scene.emitterVec.size() };
+
+    std::vector<DistributedImage> images(planes.size());
+    for (size_t i = 0; i < planes.size(); i++) {
+        images[i].format = planes[i]->format;
+        images[i].width = planes[i]->width;
+        images[i].height = planes[i]->height;
+        images[i].padding = 0;
+        images[i].offset = writeSection(planes[i]->GetTexels(), GetDistributedImageSize(images[i]));
+    }
+    header.images = { writeSection(images.data(), images.size() * sizeof(DistributedImage)), images.size() };
+
+    // Now that we know where everything went
+    written &= (fseek(file, 0, SEEK_SET) == 0);
+    written &= (fwrite(&header, sizeof(header), 1, file) == 1);
+    written &= (fclose(file) == 0);
+    return written;
+}
+
+// Points a view at a section of the mapped cache, or returns false if the section does not fit in the file
+template<typename T>
+bool ViewDistributedSection(const MappedFile& file, const DistributedSection& section, ArrayView<T>& view) {
+    if (section.offset > file.GetSize() || section.count > (file.GetSize() - section.offset) / sizeof(T))
+        return false;
+
+    view = ArrayView<T>((const T*)(file.GetData() + section.offset), section.count);
+    return true;
+}
+
+int Renderer::RunReferenceWorker(const std::string& scenePath, const std::string& address, uint16_t port) {
+    MappedFile file;
+    if (!file.Open(scenePath) || file.GetSize() < sizeof(DistributedSceneHeader)) {
+        std::cout << "Worker could not map the scene cache \"" << scenePath << "\"\n";
+        return 1;
+    }
+
+    DistributedSceneHeader header;
+    memcpy(&header, file.GetData(), sizeof(header));
+
+    ArrayView<CompactTriangle> triangles;
+    ArrayView<NodeSerialized> nodes;
+    ArrayView<int32_t> references;
+    ArrayView<MaterialInstance> materials;
+    ArrayView<LightTriangleInfo> emitters;
+    ArrayView<DistributedImage> images;
+    bool valid =
+        header.magic == kDistributedMagic && header.version == kDistributedVersion &&
+        ViewDistributedSection(file, header.triangles, triangles) &&
+        ViewDistributedSection(file, header.nodes, nodes) &&
+        ViewDistributedSection(file, header.references, references) &&
+        ViewDistributedSection(file, header.materials, materials) &&
+        ViewDistributedSection(file, header.emitters, emitters) &&
+        ViewDistributedSection(file, header.images, images) &&
+        images.size() >= 6;
+    for (size_t i = 0; valid && i < images.size(); i++)
+        valid = (images[i].width > 0 && images[i].height > 0 && images[i].format <= TexelFormat::RGBA32F &&
+            images[i].offset <= file.GetSize() && GetDistributedImageSize(images[i]) <= file.GetSize() - images[i].offset);
+
+    if (!valid) {
+        std::cout << "Worker found a scene cache that is damaged or from another version\n";
+        return 1;
+    }
+
+    Camera camera(1.0f, 1.0f, 1.0f, 0.0f);
+    memcpy(&camera, header.camera, sizeof(Camera));
+
+    // The textures sample straight out of the mapping
+    TextureCubemap skybox;
+    std::vector<Texture2D> planes(images.size() - 6);
+    std::vector<Texture*> textures;
+    textures.push_back(&skybox);
+    for (size_t i = 0; i < images.size(); i++) {
+        Texture2D& plane = (i < 6 ? skybox.faces[i] : planes[i - 6]);
+        plane.ViewData(images[i].format, images[i].width, images[i].height, file.GetData() + images[i].offset);
+        if (i >= 6)
+            textures.push_back(&plane);
+    }
+
+    // Cheap enough to rebuild next to the mapping rather than shipping it in the cache
+    Distribution2D environment;
+    BuildEnvironmentDistribution(skybox, environment);
+
+    Socket connection;
+    if (!connection.Connect(address.c_str(), port)) {
+        std::cout << "Worker could not connect to " << address << ':' << port << '\n';
+        return 1;
+    }
+
+    DistributedHello hello = { kDistributedMagic, kDistributedVersion, GetOwnProcessId() };
+    if (!connection.Send(&hello, sizeof(hello)))
+        return 1;
+
+    std::vector<vec3> tile;
+    DistributedJob job;
+    while (connection.Receive(&job, sizeof(job)) && job.width != 0) {
+        tile.resize((size_t)job.width * job.height);
+        for (uint32_t y = 0; y < job.height; y++) {
+            for (uint32_t x = 0; x < job.width; x++) {
+                PixelEstimate estimate;
+                PathTraceImage(estimate, job.x + x, job.y + y, job.firstSample, job.numSamples, header.width, header.height, camera, triangles, nodes, references, materials, textures, emitters, header.totalLightArea, environment);
+                tile[(size_t)y * job.width + x] = estimate.mean;
+            }
+        }
+
+        if (!connection.Send(&job, sizeof(job)) || !connection.Send(tile.data(), tile.size() * sizeof(vec3)))
+            return 1;
+    }
+
+    return 0;
+}
+
+// The coordinator's end of a worker connection, along with what we report about it at the end
+struct DistributedWorker {
+    Socket connection;
+    uint32_t processId;
+    bool alive;
+    uint32_t jobsDone;
+    uint64_t pathsTraced;
+    double busyTime; // Seconds from sending a job to having its tile back
+};
+
+void Renderer::RenderReferenceDistributed(const Camera& camera) {
+    auto filename = std::to_string(std::time(nullptr));
+
+    if (!SaveDistributedScene(kDistributedScenePath, camera)) {
+        std::cout << "Failed to write the scene cache for the workers\n";
+        return;
+    }
+
+    Socket listener;
+    if (!listener.Listen(kDistributedAddress, 0, kNumDistributedWorkers)) {
+        std::cout << "Failed to open a socket for the workers\n";
+        return;
+    }
+
+    std::string executable = GetExecutablePath();
+    std::vector<std::string> arguments = { executable, "--worker", kDistributedScenePath, kDistributedAddress, std::to_string(listener.GetPort()) };
+
+    std::vector<std::unique_ptr<ChildProcess>> processes;
+    for (uint32_t i = 0; i < kNumDistributedWorkers; i++) {
+        processes.emplace_back(new ChildProcess);
+        if (!processes.back()->Launch(arguments)) {
+            std::cout << "Failed to launch worker " << i << " from \"" << executable << "\"\n";
+            processes.pop_back();
+        }
+    }
+
+    std::vector<std::unique_ptr<DistributedWorker>> workers;
+    while (workers.size() < processes.size()) {
+        std::unique_ptr<DistributedWorker> worker(new DistributedWorker);
+        DistributedHello hello;
+        if (!listener.Accept(worker->connection, kDistributedConnectTimeout))
+            break;
+        if (!worker->connection.Receive(&hello, sizeof(hello)) || hello.magic != kDistributedMagic || hello.version != kDistributedVersion)
+            continue;
+
+        worker->processId = hello.processId;
+        worker->alive = true;
+        worker->jobsDone = 0;
+        worker->pathsTraced = 0;
+        worker->busyTime = 0.0;
+        workers.push_back(std::move(worker));
+    }
+    listener.Close();
+    std::cout << workers.size() << " of " << processes.size() << " workers connected\n";
+
+    if (workers.empty()) {
+        for (std::unique_ptr<ChildProcess>& process : processes) {
+            process->Kill();
+            process->Wait();
+        }
+        return;
+    }
+
+    // Every tile gets its first batch of samples before any tile gets its second, so the whole image sharpens together
+    std::deque<DistributedJob> jobs;
+    for (uint32_t sample = 0; sample < KNumRefSamples; sample += kDistributedJobSamples) {
+        for (uint32_t y = 0; y < viewportHeight; y += kDistributedTileSize) {
+            for (uint32_t x = 0; x < viewportWidth; x += kDistributedTileSize) {
+                DistributedJob job;
+                job.x = x;
+                job.y = y;
+                job.width = std::min(kDistributedTileSize, viewportWidth - x);
+                job.height = std::min(kDistributedTileSize, viewportHeight - y);
+                job.firstSample = sample;
+                job.numSamples = kDistributedJobSamples;
+                jobs.push_back(job);
+            }
+        }
+    }
+    size_t numJobs = jobs.size();
+    size_t jobsDone = 0;
+    uint32_t jobsInFlight = 0;
+
+    std::vector<vec3> radianceSum(numPixels, vec3(0.0f));
+    std::vector<uint32_t> sampleCount(numPixels, 0);
+    std::vector<uint8_t> image(3ULL * numPixels, 0);
+
+    // Guards everything above, the workers only hold it to take a job or merge a tile
+    std::mutex jobMutex;
+    std::condition_variable jobsChanged;
+
+    auto start = std::time(nullptr);
+    std::vector<std::thread> threads;
+    for (std::unique_ptr<DistributedWorker>& workerPtr : workers) {
+        threads.emplace_back([&](DistributedWorker& worker) {
+            std::vector<vec3> tile;
+            std::unique_lock<std::mutex> lock(jobMutex);
+            while (true) {
+                // A job in flight could still come back from a dead worker, so only quit once nothing is left anywhere
+                jobsChanged.wait(lock, [&]() { return !jobs.empty() || jobsInFlight == 0; });
+                if (jobs.empty())
+                    return;
+
+                DistributedJob job = jobs.front();
+                jobs.pop_front();
+                jobsInFlight++;
+                lock.unlock();
+
+                Timer jobTimer;
+                jobTimer.Begin();
+                DistributedJob echo;
+                tile.resize((size_t)job.width * job.height);
+                bool received =
+                    worker.connection.Send(&job, sizeof(job)) &&
+                    worker.connection.Receive(&echo, sizeof(echo)) && memcmp(&echo, &job, sizeof(job)) == 0 &&
+                    worker.connection.Receive(tile.data(), tile.size() * sizeof(vec3));
+                jobTimer.End();
+
+                lock.lock();
+                jobsInFlight--;
+                if (!received) {
+                    std::cout << "Worker " << worker.processId << " is gone, handing its tile to the others\n";
+                    jobs.push_front(job);
+                    worker.alive = false;
+                    worker.connection.Close();
+                    jobsChanged.notify_all();
+                    return;
+                }
+
+                for (uint32_t y = 0; y < job.height; y++) {
+                    for (uint32_t x = 0; x < job.width; x++) {
+                        size_t pixelIndex = (size_t)(job.y + y) * viewportWidth + job.x + x;
+                        radianceSum[pixelIndex] += tile[(size_t)y * job.width + x] * (float)job.numSamples;
+                        sampleCount[pixelIndex] += job.numSamples;
+                        WriteReferencePixel(image.data(), job.x + x, job.y + y, viewportWidth, radianceSum[pixelIndex] / (float)sampleCount[pixelIndex]);
+                    }
+                }
+
+                jobsDone++;
+                worker.jobsDone++;
+                worker.pathsTraced += (uint64_t)tile.size() * job.numSamples;
+                worker.busyTime += jobTimer.Delta;
+                if (jobs.empty() && jobsInFlight == 0)
+                    jobsChanged.notify_all();
+            }
+        }, std::ref(*workerPtr));
+    }
+
+    Texture2D pixels;
+    pixels.CreateBinding();
+    pixels.LoadData(GL_RGB, GL_RGB, GL_UNSIGNED_BYTE, viewportWidth, viewportHeight, image.data());
+    pixels.BindTextureUnit(15, GL_TEXTURE_2D);
+
+    ShaderRasterization imagePresent;
+    imagePresent.CompileFiles("extra/Image.vert", "extra/Image.frag");
+    imagePresent.CreateBinding();
+    imagePresent.LoadInteger("image", 15);
+
+    auto printThroughput = [&]() {
+        double elapsed = (double)std::max<time_t>(std::time(nullptr) - start, 1);
+        for (const std::unique_ptr<DistributedWorker>& worker : workers) {
+            std::cout << "\tWorker " << worker->processId << (worker->alive ? "" : " (dead)") << ": " << worker->jobsDone << " tiles, " << worker->pathsTraced / elapsed / 1e6 << " million paths/s, busy " << 100.0 * worker->busyTime / elapsed << "% of the time\n";
+        }
+    };
+
+    Timer progressTimer;
+    progressTimer.Begin();
+    while (true) {
+        jobMutex.lock();
+        bool finished = (jobs.empty() && jobsInFlight == 0);
+        bool anyAlive = std::any_of(workers.begin(), workers.end(), [](const std::unique_ptr<DistributedWorker>& worker) { return worker->alive; });
+        if (!finished && anyAlive)
+            pixels.LoadData(GL_RGB, GL_RGB, GL_UNSIGNED_BYTE, viewportWidth, viewportHeight, image.data());
+        size_t currentJobsDone = jobsDone;
+        jobMutex.unlock();
+
+        if (finished || !anyAlive)
+            break;
+
+        glClear(GL_COLOR_BUFFER_BIT);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        bindedWindow->Update();
+
+        progressTimer.End();
+        if (progressTimer.Delta >= 1.0) {
+            std::cout << "Distributed rendering " << 100.0f * currentJobsDone / numJobs << "% of " << numJobs << " tiles complete\n";
+            jobMutex.lock();
+            printThroughput();
+            jobMutex.unlock();
+            progressTimer.Begin();
+        }
+    }
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    imagePresent.Free();
+    pixels.Free();
+
+    // Whoever is still connected gets told to quit, and anything else is killed so that nothing lingers after we are done
+    DistributedJob quit;
+    memset(&quit, 0, sizeof(quit));
+    std::vector<uint32_t> quitIds;
+    for (std::unique_ptr<DistributedWorker>& worker : workers) {
+        if (worker->alive && worker->connection.Send(&quit, sizeof(quit)))
+            quitIds.push_back(worker->processId);
+        worker->connection.Close();
+    }
+    for (std::unique_ptr<ChildProcess>& process : processes) {
+        if (std::find(quitIds.begin(), quitIds.end(), process->GetId()) == quitIds.end())
+            process->Kill();
+        process->Wait();
+    }
+
+    auto deltaT = std::time(nullptr) - start;
+    std::cout << "Throughput per worker over " << deltaT << " seconds:\n";
+    printThroughput();
+    if (jobsDone < numJobs)
+        std::cout << "Every worker died, saving the " << 100.0f * jobsDone / numJobs << "% of the image that is done\n";
+
+    std::vector<vec3> radiance(numPixels);
+    for (size_t i = 0; i < numPixels; i++)
+        radiance[i] = (sampleCount[i] > 0 ? radianceSum[i] / (float)sampleCount[i] : vec3(0.0f));
+
+    std::string hdrPath = "res/screenshots/" + filename + "-DISTRIBUTED" + GetHDRExtension(kReferenceHDRFormat);
+    WriteCapture("res/screenshots/" + filename + '-' + std::to_string(deltaT) + "-DISTRIBUTED.png", CaptureFormat::PNG, viewportWidth, viewportHeight, radiance, 1.0f);
+    imageWriter.WriteHDR(hdrPath, viewportWidth, viewportHeight, std::move(radiance), kReferenceHDRFormat);
+}
+
+/*
+Traversal benchmark so we can compare intersection routines and BVH settings without the noise of shading
+We first trace primary rays to find the first bounce, and then trace diffuse rays from those hits since they are much less coherent
+Everything is generated ahead of time and only the traversal itself is timed
+At the end we also time PathTraceImage against PathTraceWavefront on full paths, shading included
+*/
+constexpr uint32_t kNumBenchmarkPasses = 4;
+constexpr uint32_t kBenchmarkChunkSize = 4096;
+constexpr uint32_t kIntegratorBenchmarkSamples = 16;
+constexpr uint32_t kIntegratorBenchmarkStride = 4; // Every 4th pixel in both directions, which keeps the path tracing part to a few seconds
+
+// The scene members are private to the renderer, so the benchmark functions get them through here
+struct BenchmarkGeometry {
+    const std::vector<CompactTriangle>& triangles;
+    const std::vector<NodeSerialized>& nodes;
+    const std::vector<QuantizedNode>& quantizedNodes;
+    const std::vector<int32_t>& references;
+    const std::vector<CompactTriangle>& leafTriangles;
+};
+
+double BenchmarkRays(const std::vector<Ray>& rays, std::vector<HitInfo>& hits, const BenchmarkGeometry& geometry, bool quantized, bool leafOrdered, TraversalStatistics* stats = nullptr) {
+    const auto& triangles = geometry.triangles;
+    const auto& nodes = geometry.nodes;
+    const auto& quantizedNodes = geometry.quantizedNodes;
+    const auto& references = geometry.references;
+    const auto* leafTriangles = (leafOrdered ? &geometry.leafTriangles : nullptr);
+
+    hits.resize(rays.size());
+
+    Timer timer;
+    timer.Begin();
+
+    std::atomic<size_t> nextChunk(0);
+    std::mutex statsMutex;
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < kNumWorkers; i++) {
+        workers.emplace_back([&]() {
+            TraversalStatistics localStats;
+            TraversalStatistics* localStatsPtr = (stats ? &localStats : nullptr);
+            while (true) {
+                size_t begin = kBenchmarkChunkSize * nextChunk++;
+                if (begin >= rays.size())
+                    break;
+
+                size_t end = std::min(begin + kBenchmarkChunkSize, rays.size());
+                for (size_t j = begin; j < end; j++) {
+                    hits[j] = HitInfo();
+                    if (quantized)
+                        TraverseQuantizedBVH(rays[j], hits[j], triangles, quantizedNodes, nodes, references, localStatsPtr);
+                    else
+                        TraverseBVH(rays[j], hits[j], triangles, nodes, references, leafTriangles, localStatsPtr);
+                }
+            }
+
+            if (stats) {
+                std::lock_guard<std::mutex> lock(statsMutex);
+                stats->Add(localStats);
+            }
+        });
+    }
+
+    for (std::thread& worker : workers)
+        worker.join();
+
+    timer.End();
+    return rays.size() / timer.Delta;
+}
+
+void PrintBenchmarkResults(const char* name, const std::vector<Ray>& rays, std::vector<HitInfo>& hits, const BenchmarkGeometry& geometry, bool quantized, bool leafOrdered = false) {
+    double rate = 0.0;
+    CacheMissCounter cacheMisses;
+    cacheMisses.Begin();
+    for (uint32_t pass = 0; pass < kNumBenchmarkPasses; pass++) {
+        rate += BenchmarkRays(rays, hits, geometry, quantized, leafOrdered);
+    }
+    cacheMisses.End();
+
+    // Counting slows down traversal, so we do it in a separate untimed pass
+    TraversalStatistics stats;
+    BenchmarkRays(rays, hits, geometry, quantized, leafOrdered, &stats);
+
+    std::cout << name << ": " << rate / kNumBenchmarkPasses / 1e6 << " MRays/s\t" << (double)stats.boxTests / rays.size() << " box tests/ray\t" << (double)stats.triangleTests / rays.size() << " triangle tests/ray";
+    if (cacheMisses.IsAvailable()) {
+        uint64_t numRays = (uint64_t)rays.size() * kNumBenchmarkPasses;
+        std::cout << "\t" << (double)cacheMisses.Misses / numRays << " cache misses/ray (" << 100.0 * cacheMisses.Misses / std::max<uint64_t>(cacheMisses.References, 1) << "% of references)";
+    }
+    if (quantized) {
+        std::cout << "\t" << 100.0 * stats.falseBoxHits / stats.boxHits << "% false positive box hits";
+    }
+    std::cout << '\n';
+}
+
+void Renderer::BenchmarkTraversal(const Camera& camera) {
+    std::vector<Ray> primaryRays;
+    std::vector<Ray> diffuseRays;
+    std::vector<HitInfo> hits;
+
+    if (scene.bvh->quantizedNodesVec.empty()) {
+        scene.bvh->EncodeQuantized();
+    }
+
+    BenchmarkGeometry geometry{ scene.triangleVec, scene.bvh->nodesVec, scene.bvh->quantizedNodesVec, scene.bvh->referenceVec, scene.bvh->leafTriangleVec };
+
+    uvec4 state(129, 12345, 6789, 1337); // Fixed seed so that runs are comparable
+
+    for (uint32_t y = 0; y < viewportHeight; y++) {
+        for (uint32_t x = 0; x < viewportWidth; x++) {
+            vec2 interpolation = vec2(x + HybridTaus(state), y + HybridTaus(state)) / vec2(viewportWidth, viewportHeight);
+            primaryRays.push_back(camera.GenRay(interpolation, HybridTaus(state), HybridTaus(state)));
+        }
+    }
+
+    BenchmarkRays(primaryRays, hits, geometry, false, false);
+    for (size_t i = 0; i < primaryRays.size(); i++) {
+        const HitInfo& hit = hits[i];
+        if (hit.depth == HitInfo().depth)
+            continue;
+
+        vec3 normal = hit.intersection.normal;
+        if (dot(normal, primaryRays[i].direction) > 0.0f)
+            normal = -normal;
+
+        vec3 normcrs = (abs(normal.y) > 0.99 ? vec3(1.0, 0.0, 0.0) : vec3(0.0, 1.0, 0.0));
+        vec3 tangent = normalize(cross(normcrs, normal));
+        vec3 bitangent = cross(tangent, normal);
+
+        float phi = 2 * M_PI * HybridTaus(state);
+        float z = HybridTaus(state);
+        float r = sqrt(1.0f - z * z);
+
+        Ray ray;
+        ray.origin = hit.intersection.position + normal * 0.001f;
+        ray.direction = mat3(tangent, bitangent, normal) * vec3(r * vec2(sin(phi), cos(phi)), z);
+        diffuseRays.push_back(ray);
+    }
+
+#ifdef WATERTIGHT_INTERSECTION
+    std::cout << "Triangle intersection: watertight\n";
+#else
+    std::cout << "Triangle intersection: Moller-Trumbore\n";
+#endif
+    PrintBenchmarkResults("Primary rays", primaryRays, hits, geometry, false);
+    PrintBenchmarkResults("Primary rays (quantized)", primaryRays, hits, geometry, true);
+    if (!geometry.leafTriangles.empty()) {
+        PrintBenchmarkResults("Primary rays (leaf ordered)", primaryRays, hits, geometry, false, true);
+    }
+    PrintBenchmarkResults("Diffuse rays", diffuseRays, hits, geometry, false);
+    PrintBenchmarkResults("Diffuse rays (quantized)", diffuseRays, hits, geometry, true);
+    if (!geometry.leafTriangles.empty()) {
+        PrintBenchmarkResults("Diffuse rays (leaf ordered)", diffuseRays, hits, geometry, false, true);
+    }
+
+    // Full paths with shading through both integrators. With OWEN_SOBOL_REFERENCE both trace the same paths, so the rays the wavefront counts are the ones the megakernel traced too
+    std::vector<ivec2> integratorPixels;
+    for (uint32_t y = 0; y < viewportHeight; y += kIntegratorBenchmarkStride) {
+        for (uint32_t x = 0; x < viewportWidth; x += kIntegratorBenchmarkStride) {
+            integratorPixels.emplace_back(x, y);
+        }
+    }
+
+    auto benchmarkIntegrator = [&](bool wavefront) {
+        std::atomic<size_t> nextChunk(0);
+        std::atomic<uint64_t> numRays(0);
+
+        Timer timer;
+        timer.Begin();
+
+        std::vector<std::thread> workers;
+        for (uint32_t i = 0; i < kNumWorkers; i++) {
+            workers.emplace_back([&]() {
+                std::vector<PixelEstimate> estimates(kWavefrontTaskPixels);
+                std::vector<WavefrontPixel> batch;
+                while (true) {
+                    size_t begin = kWavefrontTaskPixels * nextChunk++;
+                    if (begin >= integratorPixels.size())
+                        break;
+
+                    size_t end = std::min(begin + kWavefrontTaskPixels, integratorPixels.size());
+                    batch.clear();
+                    for (size_t j = begin; j < end; j++) {
+                        ivec2 pixel = integratorPixels[j];
+                        PixelEstimate& estimate = estimates[j - begin];
+                        estimate = PixelEstimate();
+                        if (wavefront)
+                            batch.push_back({ (uint32_t)pixel.x, (uint32_t)pixel.y, 0, kIntegratorBenchmarkSamples, &estimate });
+                        else
+                            PathTraceImage(estimate, pixel.x, pixel.y, 0, kIntegratorBenchmarkSamples, viewportWidth, viewportHeight, camera, scene.triangleVec, scene.bvh->nodesVec, scene.bvh->referenceVec, scene.materialVec, scene.textures, scene.emitterVec, scene.totalLightArea, scene.environmentDistribution);
+                    }
+
+                    if (wavefront)
+                        numRays += PathTraceWavefront(batch, viewportWidth, viewportHeight, camera, scene.triangleVec, scene.bvh->nodesVec, scene.bvh->referenceVec, scene.materialVec, scene.textures, scene.emitterVec, scene.totalLightArea, scene.environmentDistribution);
+                }
+            });
+        }
+
+        for (std::thread& worker : workers)
+            worker.join();
+
+        timer.End();
+        return std::make_pair(timer.Delta, numRays.load());
+    };
+
+    double megakernelTime = benchmarkIntegrator(false).first;
+    auto wavefront = benchmarkIntegrator(true);
+    double numPaths = (double)integratorPixels.size() * kIntegratorBenchmarkSamples;
+#ifdef OWEN_SOBOL_REFERENCE
+    std::cout << "Megakernel: " << wavefront.second / megakernelTime / 1e6 << " MRays/s\t" << numPaths / megakernelTime / 1e6 << " MPaths/s\n";
+#else
+    // The megakernel draws from the random streams then, so it traces other paths and only the path rate can be compared
+    std::cout << "Megakernel: " << numPaths / megakernelTime / 1e6 << " MPaths/s\n";
+#endif
+    std::cout << "Wavefront: " << wavefront.second / wavefront.first / 1e6 << " MRays/s\t" << numPaths / wavefront.first / 1e6 << " MPaths/s\t" << wavefront.second / numPaths << " rays/path\n";
+}
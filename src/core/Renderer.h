@@ -7,7 +7,17 @@
 #include "Shader.h"
 #include "Texture.h"
 #include "../math/Camera.h"
+#include "../misc/ImageWriter.h"
 #include <thread>
+#include <deque>
+
+// PNG is tonemapped the same way as the window, the others keep the linear radiance
+enum class CaptureFormat {
+	PNG,
+	PFM, // Raw 32 bit floats
+	EXR_HALF,
+	EXR_FLOAT,
+};
 
 class Renderer {
 public:
@@ -20,16 +30,36 @@ public:
 	void ResetSamples();
 	uint32_t GetNumSamples();
 
-	void SaveScreenshot(const std::string& filename);
+	/*
+	Queues the image accumulated so far to be written. The readback finishes over the next frames and the encoding happens on the writer thread,
+	so the render loop never waits on either of them
+	*/
+	void SaveScreenshot(const std::string& filename, CaptureFormat format = CaptureFormat::PNG);
+	// Captures every interval samples into a new numbered sequence each time the samples are reset, 0 turns it off
+	void SetCaptureInterval(uint32_t interval, CaptureFormat format);
+	uint32_t GetCaptureInterval();
+	// Blocks until every capture queued so far is on disk
+	void FlushCaptures();
 	void RenderReference(const Camera& camera);
+	// Same as RenderReference, but the tiles are traced by worker processes that RunReferenceWorker runs in
+	void RenderReferenceDistributed(const Camera& camera);
+	// Entry point of a worker process, which does not need a window or GL. Returns the exit code of the process
+	static int RunReferenceWorker(const std::string& scenePath, const std::string& address, uint16_t port);
+	void BenchmarkTraversal(const Camera& camera);
 private:
+	// Everything the CPU path tracer needs in one file, for the workers of RenderReferenceDistributed to map
+	bool SaveDistributedScene(const std::string& path, const Camera& camera);
+
+	// Hands the readbacks that the GPU is done with to the writer, in the order they were queued. Waits for the oldest ones while more than maxPending are left
+	void ServiceCaptures(size_t maxPending);
+	// Scales the radiance and encodes it on the writer thread, for both the GPU readbacks and the CPU renderers
+	void WriteCapture(const std::string& path, CaptureFormat format, uint32_t width, uint32_t height, std::vector<glm::vec3> radiance, float scale);
+
 	uint32_t viewportWidth, viewportHeight, numPixels;
 	Window* bindedWindow;
 
 	Buffer quadBuf;
 	VertexArray quadArr;
-	Buffer cubeBuf;
-	VertexArray cubeArr;
 	ShaderRasterization present;
 	Texture2D accum;
 
@@ -45,11 +75,38 @@ private:
 	Buffer pixelPoolBuf;
 	TextureBuffer pixelPoolTex;
 
+	// Blue noise rank tiles for every dimension that Iterative.comp dithers
+	Buffer blueNoiseBuf;
+	TextureBuffer blueNoiseTex;
+
 	Buffer debugBuf;
 
+	// Saves the reference renders and captures without making the next frame wait on the disk
+	BackgroundImageWriter imageWriter;
+
+	// A copy of accum in a pixel buffer, which can be mapped without a stall once its fence has passed
+	struct CaptureReadback {
+		Buffer buffer;
+		GLsync fence;
+		std::string path;
+		CaptureFormat format;
+		int numSamples;
+	};
+	std::deque<CaptureReadback> captureReadbacks;
+	std::vector<Buffer> freeCaptureBuffers;
+
+	uint32_t captureInterval;
+	CaptureFormat captureIntervalFormat;
+	uint32_t captureSequence;
+	std::string captureSequencePath;
+
 	int frameCounter;
 	int numSamples;
 	bool running;
+
+	// Frames traced so far while timing the leaf ordered triangles against the references, and the time each form took
+	uint32_t leafLayoutTrialFrame;
+	double leafLayoutTrialTime[2];
 };
 
 #endif
@@ -17,6 +17,7 @@
 #include <SOIL2.h>
 #include <cmath>
 #include <algorithm>
+#include <atomic>
 
 #include <glm/gtx/matrix_transform_2d.hpp>
 // Use specifically for GLTF models
@@ -30,6 +31,28 @@
 
 using namespace glm;
 
+/*
+Progressive BVH refinement
+A full SBVH build takes a while on big scenes, so instead we start rendering on an object split only BVH, which is much faster to build
+The SBVH is built on a background thread from a copy of the triangles and swapped in once it is done
+Both trees index the same triangle buffer, so the swap does not change the image, only how fast we get it
+*/
+#define PROGRESSIVE_BVH
+
+// Keep a copy of the triangles in leaf order next to the references, the renderer then picks whichever form traces faster for this scene
+#define LEAF_ORDERED_TRIANGLES
+
+// Build the final BVH with the exact full sweep over presorted references instead of the binned SBVH. It finds the best object split at every node, but never splits triangles across nodes
+//#define FULL_SWEEP_BVH
+
+// Scenes that the builders could not fit in this much memory are built out of core instead, through bucket files in the scratch directory
+constexpr size_t kBVHMemoryLimit = 4ULL << 30;
+constexpr const char* kBVHScratchDirectory = "cache/bvh/";
+
+// Chop up triangles whose boxes are much bigger than they are before the final build, see PresplitTriangles
+#define PRESPLIT_TRIANGLES
+constexpr float kPresplitFraction = 0.1f; // Extra references we allow, relative to the number of triangles
+
 // vec4 alignments: 4 8 12 16 of any combination of 4 byte values
 struct CompactVertex {
     // 0 - starting
@@ -230,6 +253,32 @@ void LoadOBJ(const std::string& path, const std::string& folder, std::vector<Ver
     }
 }
 
+// The BVH we render with in the end, either right away or after the quick one from PROGRESSIVE_BVH
+void BuildFinalHierarchy(BoundingVolumeHierarchy& bvh, std::vector<CompactTriangle>& triangles) {
+#ifdef PRESPLIT_TRIANGLES
+    DuplicationBudget presplitBudget = DuplicationBudget::Fraction(kPresplitFraction);
+#else
+    DuplicationBudget presplitBudget = DuplicationBudget::None();
+#endif
+#ifdef FULL_SWEEP_BVH
+    bvh.BuildFullSweep(triangles, presplitBudget);
+#else
+    bvh.BuildBinnedSpatial(triangles, DuplicationBudget(), presplitBudget);
+#endif
+}
+
+// Puts the triangles in the form the intersection tests read them in
+void PrecomputeIntersectionData(std::vector<CompactTriangle>& triangles) {
+#ifndef WATERTIGHT_INTERSECTION
+    // Precompute MT information; it is always posssible to get the actual positions backa gain using the first vertex
+    // The watertight test needs the exact vertex positions, so we cannot do this when it is enabled
+    for (auto& tri : triangles) {
+        tri.position1 = tri.position1 - tri.position0;
+        tri.position2 = tri.position2 - tri.position0;
+    }
+#endif
+}
+
 void Scene::LoadScene(const std::string& path, TextureCubemap* environment) {
     textures.push_back(environment);
 
@@ -291,12 +340,41 @@ void Scene::LoadScene(const std::string& path, TextureCubemap* environment) {
         triangles.push_back(triangle);
     }
 
-    bvh.BuildBinnedSpatial(triangles);
-
-    struct LightTriangleInfo {
-        float area;
-        uint32_t index;
-    };
+    bvh = std::make_shared<BoundingVolumeHierarchy>();
+    size_t buildMemory = BoundingVolumeHierarchy::GetBuildMemory(triangles.size());
+    bool outOfCore = (buildMemory > kBVHMemoryLimit);
+    if (outOfCore) {
+        std::cout << "Building the BVH out of core, the builder would need " << buildMemory / (1 << 20) << " MB\n";
+        bvh->BuildOutOfCore(triangles, kBVHMemoryLimit, kBVHScratchDirectory);
+    }
+    else {
+#ifdef PROGRESSIVE_BVH
+        bvh->BuildBinnedSpatial(triangles, DuplicationBudget::None());
+#else
+        BuildFinalHierarchy(*bvh, triangles);
+#endif
+    }
+    std::atomic_store(&cpuBvh, std::shared_ptr<const BoundingVolumeHierarchy>(bvh));
+
+#ifdef PROGRESSIVE_BVH
+    // The refined build would not fit in memory either, so an out of core tree is the one we keep
+    if (!outOfCore) {
+        // The copy is taken before the MT precompute below messes with the positions
+        refinedBvh = std::async(std::launch::async, [this](std::vector<CompactTriangle> positions) {
+            auto refined = std::make_shared<BoundingVolumeHierarchy>();
+            BuildFinalHierarchy(*refined, positions);
+#ifdef LEAF_ORDERED_TRIANGLES
+            // Nobody else can see the refined BVH yet, so this is the last chance to change it without racing the render threads
+            PrecomputeIntersectionData(positions);
+            refined->BuildLeafOrderedTriangles(positions);
+#endif
+
+            // The CPU renderer can start using it right away, while the GPU has to wait for the main thread to upload it
+            std::atomic_store(&cpuBvh, std::shared_ptr<const BoundingVolumeHierarchy>(refined));
+            return refined;
+        }, triangles);
+    }
+#endif
 
     std::vector<LightTriangleInfo> emitters;
 
@@ -330,11 +408,12 @@ void Scene::LoadScene(const std::string& path, TextureCubemap* environment) {
     }
     std::cout << "Total emitter area: " << totalLightArea << '\n';
 
-    // Precompute MT information; it is always posssible to get the actual positions backa gain using the first vertex
-    for (auto& tri : triangles) {
-        tri.position1 = tri.position1 - tri.position0;
-        tri.position2 = tri.position2 - tri.position0;
-    }
+    PrecomputeIntersectionData(triangles);
+
+#ifdef LEAF_ORDERED_TRIANGLES
+    bvh->BuildLeafOrderedTriangles(triangles);
+#endif
+    bvh->Upload();
 
     materialsBuf.CreateBinding(BUFFER_TARGET_SHADER_STORAGE);
     materialsBuf.UploadData(materials, GL_STATIC_DRAW);
@@ -353,9 +432,26 @@ void Scene::LoadScene(const std::string& path, TextureCubemap* environment) {
     lightTex.CreateBinding();
     lightTex.SelectBuffer(&lightBuf, GL_RG32F);
 
+    emitterVec = emitters;
     triangleVec = triangles;
 }
 
+bool Scene::UpdateHierarchy(void) {
+    if (!refinedBvh.valid() || refinedBvh.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return false;
+    }
+
+    // GL keeps deleted buffers alive until the draws that were already queued with them are done, so we can free the old ones right away
+    // The CPU renderer already has it, so this only adds the GL objects, which the render threads never touch
+    auto refined = refinedBvh.get();
+    refined->Upload();
+    bvh->Free();
+    bvh = refined;
+
+    std::cout << "Swapped in the refined BVH\n";
+    return true;
+}
+
 /*
 std::string CXXPath = Path;
     std::string Folder = CXXPath.substr(0, CXXPath.find_last_of('/') + 1);
@@ -3,8 +3,10 @@
 #include "BVH.h"
 #include "Texture.h"
 #include "Buffer.h"
+#include "../math/Distribution.h"
 #include <string>
 #include <memory>
+#include <future>
 #include <glm/glm.hpp>
 using namespace glm;
 
@@ -16,15 +18,33 @@ struct MaterialInstance {
 	int isEmissive;
 };
 
+// Emissive triangles, sorted by area. The area holds the running total so that we can binary search for the triangle a random area lands on
+struct LightTriangleInfo {
+	float area;
+	uint32_t index;
+};
+
 class Scene {
 public:
 	void LoadScene(const std::string& path, TextureCubemap* env_path);
+
+	// Swaps in the refined BVH once its background build is done. Must be called on the thread that owns the GL context
+	// Returns true when the GPU copy changed and the BVH textures need to be bound again
+	bool UpdateHierarchy(void);
 private:
 	std::vector<CompactTriangle> triangleVec;
 	Buffer vertexBuf;
 	TextureBuffer vertexTex;
 
-	BoundingVolumeHierarchy bvh;
+	// The hierarchy the GPU traces against. Only the main thread touches it since it owns GL objects
+	std::shared_ptr<BoundingVolumeHierarchy> bvh;
+
+	// The newest hierarchy for the CPU renderer, which the background build publishes as soon as it is done. Always read it with std::atomic_load
+	// Render threads hold on to the version they loaded until their current tile is done, so an old version lives on until nobody uses it
+	std::shared_ptr<const BoundingVolumeHierarchy> cpuBvh;
+
+	// The SBVH that is being built in the background, see LoadScene
+	std::future<std::shared_ptr<BoundingVolumeHierarchy>> refinedBvh;
 
 	// We never actually use the texture names after initialization but I keep them anyway
 	std::vector<Texture*> textures;
@@ -32,9 +52,13 @@ private:
 	Buffer materialsBuf;
 
 	float totalLightArea;
+	std::vector<LightTriangleInfo> emitterVec;
 	Buffer lightBuf;
 	TextureBuffer lightTex;
 
+	// For importance sampling the environment map on the CPU, the GPU still only reaches it through misses
+	Distribution2D environmentDistribution;
+
 	friend class Shader;
 	friend class Renderer;
 };
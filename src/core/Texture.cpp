@@ -1,15 +1,23 @@
 #include "Texture.h"
 #include "Buffer.h"
+#include "../math/Half.h"
+#include "../math/SIMD.h"
 
 #include <stdio.h>
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <iostream>
 #include <map>
 #include <filesystem>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <stb_image.h>
 
 // perhaps I should use a proper system for taking into account already loaded textures but this will do fine, just for now
 //std::map<std::string, GLuint> PreloadedTextureList;
@@ -168,45 +176,371 @@ void Texture2D::LoadData(GLenum DestinationFormat, GLenum SourceFormat, GLenum S
 	glTexImage2D(GL_TEXTURE_2D, 0, DestinationFormat, X, Y, 0, SourceFormat, SourceType, Data);
 }
 
-void Texture2D::SaveData(GLenum SourceType, uint32_t X, uint32_t Y, void* Data) {
+uint32_t GetTexelSize(TexelFormat format) {
+	switch (format) {
+	case TexelFormat::RGBA8:
+		return 4;
+	case TexelFormat::RGBA16F:
+		return 8;
+	default:
+		return 16;
+	}
+}
+
+uint32_t GetTileRows(const MipLevel& level) {
+	return (level.height + kTexelTileSize - 1) / kTexelTileSize;
+}
+
+uint32_t TexelAddress(const MipLevel& level, uint32_t x, uint32_t y) {
+	uint32_t tile = (y / kTexelTileSize) * level.tilesPerRow + x / kTexelTileSize;
+	uint32_t morton = (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2);
+	return level.offset + kTexelTileSize * kTexelTileSize * tile + morton;
+}
+
+// Texture coordinates repeat, and anything that is not a finite number ends up at 0 instead of at an address way out of bounds
+float WrapTexcoord(float x) {
+	x -= floor(x);
+	return (x >= 0.0f && x < 1.0f ? x : 0.0f);
+}
+
+void Texture2D::ComputeLayout(TexelFormat Format, uint32_t X, uint32_t Y) {
+	format = Format;
 	width = X;
 	height = Y;
+	lodBias = 0.5f * log2((float)X * (float)Y);
+
+	numLevels = 0;
+	uint32_t offset = 0;
+	while (numLevels < kMaxMipLevels) {
+		MipLevel& level = levels[numLevels++];
+		level.width = X;
+		level.height = Y;
+		level.tilesPerRow = (X + kTexelTileSize - 1) / kTexelTileSize;
+		level.offset = offset;
+		offset += level.tilesPerRow * GetTileRows(level) * kTexelTileSize * kTexelTileSize;
+
+		if (X == 1 && Y == 1)
+			break;
+		X = (X > 1 ? X / 2 : 1);
+		Y = (Y > 1 ? Y / 2 : 1);
+	}
+}
+
+size_t Texture2D::GetStorageSize() const {
+	const MipLevel& last = levels[numLevels - 1];
+	size_t texels = last.offset + (size_t)last.tilesPerRow * GetTileRows(last) * kTexelTileSize * kTexelTileSize;
+	return texels * GetTexelSize(format);
+}
 
-	if (SourceType == GL_UNSIGNED_BYTE)
-		imagei = new uint8_t[3ULL * width * height];
-	else
-		imagef = new float[3ULL * width * height];
-
-	for (uint32_t i = 0; i < height; i++) {
-		for (uint32_t j = 0; j < width; j++) {
-			int idx = i * width + j;
-			int didx = 3 * idx;
-			int sidx = 4 * idx;
-			if (SourceType == GL_UNSIGNED_BYTE) {
-				uint8_t* source = (uint8_t*)Data;
-				imagei[didx    ] = source[sidx    ];
-				imagei[didx + 1] = source[sidx + 1];
-				imagei[didx + 2] = source[sidx + 2];
+const uint8_t* Texture2D::GetTexels() const {
+	return (view ? view : storage.data());
+}
+
+void Texture2D::SaveData(GLenum SourceType, uint32_t X, uint32_t Y, void* Data) {
+	SaveData(SourceType, X, Y, Data, SourceType == GL_UNSIGNED_BYTE ? TexelFormat::RGBA8 : TexelFormat::RGBA16F);
+}
+
+void Texture2D::SaveData(GLenum SourceType, uint32_t X, uint32_t Y, void* Data, TexelFormat Format) {
+	ComputeLayout(Format, X, Y);
+	storage.assign(GetStorageSize(), 0);
+	view = nullptr;
+
+	// The mip chain is filtered in floats no matter the format so that the small levels do not pile up rounding errors
+	std::vector<vec4> current((size_t)X * Y);
+	for (size_t i = 0; i < current.size(); i++) {
+		if (SourceType == GL_UNSIGNED_BYTE) {
+			uint8_t* source = (uint8_t*)Data + 4 * i;
+			current[i] = vec4(source[0], source[1], source[2], source[3]) / 255.0f;
+		}
+		else
+			current[i] = ((vec4*)Data)[i];
+	}
+
+	uint32_t texelSize = GetTexelSize(format);
+	for (uint32_t i = 0; i < numLevels; i++) {
+		const MipLevel& level = levels[i];
+
+		if (i > 0) {
+			// 2x2 box filter, odd sizes simply drop their last row or column like most drivers do
+			const MipLevel& parent = levels[i - 1];
+			std::vector<vec4> next((size_t)level.width * level.height);
+			for (uint32_t y = 0; y < level.height; y++) {
+				uint32_t y0 = std::min(2 * y, parent.height - 1) * parent.width;
+				uint32_t y1 = std::min(2 * y + 1, parent.height - 1) * parent.width;
+				for (uint32_t x = 0; x < level.width; x++) {
+					uint32_t x0 = std::min(2 * x, parent.width - 1);
+					uint32_t x1 = std::min(2 * x + 1, parent.width - 1);
+					next[(size_t)y * level.width + x] = 0.25f * (current[y0 + x0] + current[y0 + x1] + current[y1 + x0] + current[y1 + x1]);
+				}
 			}
-			else {
-				vec4* source = (vec4*)Data;
-				imagef[didx    ] = source[idx].r;
-				imagef[didx + 1] = source[idx].g;
-				imagef[didx + 2] = source[idx].b;
+			current.swap(next);
+		}
+
+		for (uint32_t y = 0; y < level.height; y++) {
+			for (uint32_t x = 0; x < level.width; x++) {
+				const vec4& color = current[(size_t)y * level.width + x];
+				uint8_t* texel = storage.data() + (size_t)TexelAddress(level, x, y) * texelSize;
+				if (format == TexelFormat::RGBA8) {
+					for (int j = 0; j < 4; j++)
+						texel[j] = (uint8_t)(clamp(color[j], 0.0f, 1.0f) * 255.0f + 0.5f);
+				}
+				else if (format == TexelFormat::RGBA16F) {
+					// Past the largest half, FloatToHalf would give infinity, which turns into NaN as soon as it gets filtered
+					vec4 clamped = clamp(color, vec4(-kMaxHalf), vec4(kMaxHalf));
+					uint16_t halves[4] = { FloatToHalf(clamped.r), FloatToHalf(clamped.g), FloatToHalf(clamped.b), FloatToHalf(clamped.a) };
+					memcpy(texel, halves, sizeof(halves));
+				}
+				else
+					memcpy(texel, &color, sizeof(color));
 			}
 		}
 	}
-	internalFormat = SourceType;
+}
+
+void Texture2D::CopyLevel(uint32_t level, void* destination) const {
+	const MipLevel& mip = levels[level];
+	uint32_t texelSize = GetTexelSize(format);
+	uint8_t* row = (uint8_t*)destination;
+	for (uint32_t y = 0; y < mip.height; y++) {
+		for (uint32_t x = 0; x < mip.width; x++)
+			memcpy(row + (size_t)x * texelSize, GetTexels() + (size_t)TexelAddress(mip, x, y) * texelSize, texelSize);
+		row += (size_t)mip.width * texelSize;
+	}
+}
+
+void Texture2D::ViewData(TexelFormat Format, uint32_t X, uint32_t Y, const void* Texels) {
+	ComputeLayout(Format, X, Y);
+	storage.clear();
+	storage.shrink_to_fit();
+	view = (const uint8_t*)Texels;
+}
+
+vec3 Texture2D::FetchTexel(const MipLevel& level, uint32_t x, uint32_t y) const {
+	const uint8_t* texel = GetTexels() + (size_t)TexelAddress(level, x, y) * GetTexelSize(format);
+	if (format == TexelFormat::RGBA8)
+		return vec3(texel[0], texel[1], texel[2]) / 255.0f;
+
+	if (format == TexelFormat::RGBA32F) {
+		vec3 color;
+		memcpy(&color, texel, sizeof(color));
+		return color;
+	}
+
+	uint16_t halves[3];
+	memcpy(halves, texel, sizeof(halves));
+	return vec3(HalfToFloat(halves[0]), HalfToFloat(halves[1]), HalfToFloat(halves[2]));
+}
+
+vec3 Texture2D::SampleBilinear(const MipLevel& level, vec2 texcoords) const {
+	// Texel centers sit at half integers, the same as GL_LINEAR
+	float x = WrapTexcoord(texcoords.x) * level.width - 0.5f;
+	float y = WrapTexcoord(texcoords.y) * level.height - 0.5f;
+	float fx = floor(x);
+	float fy = floor(y);
+	float tx = x - fx;
+	float ty = y - fy;
+
+	// Only the first texel can fall off the left or top edge, and only the second off the right or bottom edge
+	uint32_t x0 = (fx < 0.0f ? level.width - 1 : (uint32_t)fx);
+	uint32_t y0 = (fy < 0.0f ? level.height - 1 : (uint32_t)fy);
+	uint32_t x1 = (x0 + 1 == level.width ? 0 : x0 + 1);
+	uint32_t y1 = (y0 + 1 == level.height ? 0 : y0 + 1);
+
+	vec3 top = FetchTexel(level, x0, y0) * (1.0f - tx) + FetchTexel(level, x1, y0) * tx;
+	vec3 bottom = FetchTexel(level, x0, y1) * (1.0f - tx) + FetchTexel(level, x1, y1) * tx;
+	return top * (1.0f - ty) + bottom * ty;
+}
+
+void Texture2D::SelectLevels(float footprint, uint32_t& fine, uint32_t& coarse, float& blend) const {
+	float lod = footprint + lodBias;
+
+	// Also catches rays that do not know their footprint, which pass in -INFINITY
+	if (!(lod > 0.0f)) {
+		fine = coarse = 0;
+		blend = 0.0f;
+	}
+	else if (lod >= (float)(numLevels - 1)) {
+		fine = coarse = numLevels - 1;
+		blend = 0.0f;
+	}
+	else {
+		fine = (uint32_t)lod;
+		coarse = fine + 1;
+		blend = lod - (float)fine;
+	}
 }
 
 vec3 Texture2D::Sample(const vec2 texcoords) const {
-	// Cast to integer coordinates
-	ivec2 texelcoords = texcoords * vec2(width, height);
-	texelcoords.x %= width;
-	texelcoords.y %= height;
-	uint32_t idx = 3 * (texelcoords.y * width + texelcoords.x);
-	// Nearest neighbor sampling
-	return (internalFormat == GL_UNSIGNED_BYTE ? vec3(imagei[idx], imagei[idx+1], imagei[idx+2]) / 255.0f : vec3(imagef[idx], imagef[idx+1], imagef[idx+2]));
+	return SampleBilinear(levels[0], texcoords);
+}
+
+vec3 Texture2D::Sample(const vec2 texcoords, float footprint) const {
+	uint32_t fine, coarse;
+	float blend;
+	SelectLevels(footprint, fine, coarse, blend);
+
+	vec3 color = SampleBilinear(levels[fine], texcoords);
+	if (blend > 0.0f)
+		color += (SampleBilinear(levels[coarse], texcoords) - color) * blend;
+	return color;
+}
+
+#ifdef SIMD_SSE2
+__m128i FloorToInt4(__m128 x) {
+	// Truncation rounds negative numbers up, so those get the all ones compare result, which is -1, added on
+	__m128i truncated = _mm_cvttps_epi32(x);
+	return _mm_add_epi32(truncated, _mm_castps_si128(_mm_cmplt_ps(x, _mm_cvtepi32_ps(truncated))));
+}
+
+// Same as WrapTexcoord, huge values and NaN fail the range check and get masked to 0
+__m128 WrapTexcoord4(__m128 x) {
+	x = _mm_sub_ps(x, _mm_cvtepi32_ps(FloorToInt4(x)));
+	__m128 inside = _mm_and_ps(_mm_cmpge_ps(x, _mm_setzero_ps()), _mm_cmplt_ps(x, _mm_set1_ps(1.0f)));
+	return _mm_and_ps(x, inside);
+}
+
+/*
+Same as TexelAddress for 4 texels
+SSE2 has no 32 bit multiply, but tile coordinates fit in 16 bits for any texture narrower than 131072 texels
+So we put the tile column and row in the low and high halves of each lane and let madd do row * tilesPerRow + column in one go
+*/
+__m128i TexelAddress4(__m128i x, __m128i y, __m128i tilesPerRow, __m128i offset) {
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i two = _mm_set1_epi32(2);
+
+	__m128i tileCoordinates = _mm_or_si128(_mm_srli_epi32(x, 2), _mm_slli_epi32(_mm_srli_epi32(y, 2), 16));
+	__m128i tile = _mm_madd_epi16(tileCoordinates, _mm_or_si128(one, _mm_slli_epi32(tilesPerRow, 16)));
+
+	__m128i mortonLow = _mm_or_si128(_mm_and_si128(x, one), _mm_slli_epi32(_mm_and_si128(y, one), 1));
+	__m128i mortonHigh = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(x, two), 1), _mm_slli_epi32(_mm_and_si128(y, two), 2));
+	return _mm_add_epi32(_mm_add_epi32(offset, _mm_slli_epi32(tile, 4)), _mm_or_si128(mortonLow, mortonHigh));
+}
+
+// There is no gather before AVX2, so the texels are loaded one at a time and then converted to floats together
+void FetchTexels4(const uint8_t* texels, TexelFormat format, __m128i address, __m128 color[3]) {
+	alignas(16) uint32_t lanes[4];
+	_mm_store_si128((__m128i*)lanes, address);
+
+	if (format == TexelFormat::RGBA8) {
+		uint32_t packed[4];
+		for (int i = 0; i < 4; i++)
+			memcpy(&packed[i], texels + 4 * (size_t)lanes[i], sizeof(uint32_t));
+
+		__m128i rgba = _mm_loadu_si128((const __m128i*)packed);
+		const __m128i mask = _mm_set1_epi32(0xFF);
+		const __m128 scale = _mm_set1_ps(1.0f / 255.0f);
+		color[0] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(rgba, mask)), scale);
+		color[1] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(rgba, 8), mask)), scale);
+		color[2] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(rgba, 16), mask)), scale);
+	}
+	else if (format == TexelFormat::RGBA32F) {
+		// Each texel is already a row of floats, so a transpose gives us the channels
+		__m128 texel[4];
+		for (int i = 0; i < 4; i++)
+			texel[i] = _mm_loadu_ps((const float*)(texels + 16 * (size_t)lanes[i]));
+		_MM_TRANSPOSE4_PS(texel[0], texel[1], texel[2], texel[3]);
+		for (int c = 0; c < 3; c++)
+			color[c] = texel[c];
+	}
+	else {
+		// The first 32 bits of a texel hold red and green, and the next 32 blue and alpha
+		uint32_t rg[4], ba[4];
+		for (int i = 0; i < 4; i++) {
+			const uint8_t* texel = texels + 8 * (size_t)lanes[i];
+			memcpy(&rg[i], texel, sizeof(uint32_t));
+			memcpy(&ba[i], texel + 4, sizeof(uint32_t));
+		}
+
+		__m128i red = _mm_loadu_si128((const __m128i*)rg);
+		color[0] = HalfToFloat4(red);
+		color[1] = HalfToFloat4(_mm_srli_epi32(red, 16));
+		color[2] = HalfToFloat4(_mm_loadu_si128((const __m128i*)ba));
+	}
+}
+
+// SampleBilinear for 4 lookups at once, where each lane can be at a different mip level
+void SampleBilinear4(const uint8_t* texels, TexelFormat format, const MipLevel* const lanes[4], __m128 u, __m128 v, __m128 color[3]) {
+	__m128i width = _mm_setr_epi32(lanes[0]->width, lanes[1]->width, lanes[2]->width, lanes[3]->width);
+	__m128i height = _mm_setr_epi32(lanes[0]->height, lanes[1]->height, lanes[2]->height, lanes[3]->height);
+	__m128i tilesPerRow = _mm_setr_epi32(lanes[0]->tilesPerRow, lanes[1]->tilesPerRow, lanes[2]->tilesPerRow, lanes[3]->tilesPerRow);
+	__m128i offset = _mm_setr_epi32(lanes[0]->offset, lanes[1]->offset, lanes[2]->offset, lanes[3]->offset);
+
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	__m128 x = _mm_sub_ps(_mm_mul_ps(WrapTexcoord4(u), _mm_cvtepi32_ps(width)), half);
+	__m128 y = _mm_sub_ps(_mm_mul_ps(WrapTexcoord4(v), _mm_cvtepi32_ps(height)), half);
+	__m128i x0 = FloorToInt4(x);
+	__m128i y0 = FloorToInt4(y);
+	__m128 tx = _mm_sub_ps(x, _mm_cvtepi32_ps(x0));
+	__m128 ty = _mm_sub_ps(y, _mm_cvtepi32_ps(y0));
+
+	// Wrap -1 around to the last texel, and the texel after the last one around to 0
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i step = _mm_set1_epi32(1);
+	x0 = _mm_add_epi32(x0, _mm_and_si128(_mm_cmplt_epi32(x0, zero), width));
+	y0 = _mm_add_epi32(y0, _mm_and_si128(_mm_cmplt_epi32(y0, zero), height));
+	__m128i x1 = _mm_add_epi32(x0, step);
+	__m128i y1 = _mm_add_epi32(y0, step);
+	x1 = _mm_andnot_si128(_mm_cmpeq_epi32(x1, width), x1);
+	y1 = _mm_andnot_si128(_mm_cmpeq_epi32(y1, height), y1);
+
+	__m128 topLeft[3], topRight[3], bottomLeft[3], bottomRight[3];
+	FetchTexels4(texels, format, TexelAddress4(x0, y0, tilesPerRow, offset), topLeft);
+	FetchTexels4(texels, format, TexelAddress4(x1, y0, tilesPerRow, offset), topRight);
+	FetchTexels4(texels, format, TexelAddress4(x0, y1, tilesPerRow, offset), bottomLeft);
+	FetchTexels4(texels, format, TexelAddress4(x1, y1, tilesPerRow, offset), bottomRight);
+
+	__m128 sx = _mm_sub_ps(one, tx);
+	__m128 sy = _mm_sub_ps(one, ty);
+	for (int i = 0; i < 3; i++) {
+		__m128 top = _mm_add_ps(_mm_mul_ps(topLeft[i], sx), _mm_mul_ps(topRight[i], tx));
+		__m128 bottom = _mm_add_ps(_mm_mul_ps(bottomLeft[i], sx), _mm_mul_ps(bottomRight[i], tx));
+		color[i] = _mm_add_ps(_mm_mul_ps(top, sy), _mm_mul_ps(bottom, ty));
+	}
+}
+#endif
+
+void Texture2D::SampleMany(uint32_t count, const vec2* texcoords, const float* footprints, vec3* results) const {
+	uint32_t i = 0;
+#ifdef SIMD_SSE2
+	const uint8_t* texels = GetTexels();
+	for (; i + 4 <= count; i += 4) {
+		const MipLevel* fine[4];
+		const MipLevel* coarse[4];
+		alignas(16) float blend[4];
+		bool trilinear = false;
+		for (uint32_t j = 0; j < 4; j++) {
+			uint32_t fineLevel = 0, coarseLevel = 0;
+			blend[j] = 0.0f;
+			if (footprints)
+				SelectLevels(footprints[i + j], fineLevel, coarseLevel, blend[j]);
+			fine[j] = &levels[fineLevel];
+			coarse[j] = &levels[coarseLevel];
+			trilinear |= (blend[j] > 0.0f);
+		}
+
+		__m128 u = _mm_setr_ps(texcoords[i].x, texcoords[i + 1].x, texcoords[i + 2].x, texcoords[i + 3].x);
+		__m128 v = _mm_setr_ps(texcoords[i].y, texcoords[i + 1].y, texcoords[i + 2].y, texcoords[i + 3].y);
+
+		__m128 color[3];
+		SampleBilinear4(texels, format, fine, u, v, color);
+		if (trilinear) {
+			__m128 coarseColor[3];
+			SampleBilinear4(texels, format, coarse, u, v, coarseColor);
+			__m128 t = _mm_load_ps(blend);
+			for (int c = 0; c < 3; c++)
+				color[c] = _mm_add_ps(color[c], _mm_mul_ps(_mm_sub_ps(coarseColor[c], color[c]), t));
+		}
+
+		alignas(16) float rgb[3][4];
+		for (int c = 0; c < 3; c++)
+			_mm_store_ps(rgb[c], color[c]);
+		for (uint32_t j = 0; j < 4; j++)
+			results[i + j] = vec3(rgb[0][j], rgb[1][j], rgb[2][j]);
+	}
+#endif
+	for (; i < count; i++)
+		results[i] = (footprints ? Sample(texcoords[i], footprints[i]) : Sample(texcoords[i]));
 }
 
 void TextureBuffer::CreateBinding() {
@@ -275,6 +609,166 @@ void TextureCubemap::LoadTexture(const std::string& wpath) {
 
 }
 
+/*
+Equirectangular to cubemap conversion, which used to be done on the GPU by rendering each face into a framebuffer
+The faces come out texel for texel the same as the GPU version did, including its habit of filling the texel for direction d with the color from -d
+*/
+constexpr uint32_t kEnvironmentCacheMagic = 0x564E4543; // "CENV"
+constexpr uint32_t kEnvironmentCacheVersion = 2;
+
+struct EnvironmentCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t faceSize;
+	TexelFormat format;
+	uint64_t faceBytes;
+};
+
+// Same FNV-1a as the BVH hash, pass in a previous hash to keep going from where it left off
+uint64_t HashBytes(const uint8_t* bytes, size_t size, uint64_t hash = 14695981039346656037ull) {
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	return hash;
+}
+
+// Direction of the center of a texel of a face, following the face layout table of the GL spec
+vec3 CubemapDirection(uint32_t face, vec2 st) {
+	float sc = 2.0f * st.x - 1.0f;
+	float tc = 2.0f * st.y - 1.0f;
+	switch (face) {
+	case 0:  return vec3( 1.0f, -tc, -sc);
+	case 1:  return vec3(-1.0f, -tc,  sc);
+	case 2:  return vec3( sc,  1.0f,  tc);
+	case 3:  return vec3( sc, -1.0f, -tc);
+	case 4:  return vec3( sc, -tc,  1.0f);
+	default: return vec3(-sc, -tc, -1.0f);
+	}
+}
+
+// GL_LINEAR with GL_CLAMP_TO_EDGE on an RGBA float image, like the GPU version sampled the HDR with
+vec4 SampleEquirectangular(const float* image, int width, int height, vec3 direction) {
+	// Same rounded constants for 1 / (2 pi) and 1 / pi as the GPU version, so that we land on the same texels
+	vec2 uv = vec2(atan2(direction.z, direction.x), asin(clamp(direction.y, -1.0f, 1.0f))) * vec2(0.1591f, 0.3183f) + 0.5f;
+
+	vec2 texel = uv * vec2(width, height) - 0.5f;
+	vec2 base = floor(texel);
+	vec2 t = texel - base;
+	int x0 = clamp((int)base.x, 0, width - 1), x1 = clamp((int)base.x + 1, 0, width - 1);
+	int y0 = clamp((int)base.y, 0, height - 1), y1 = clamp((int)base.y + 1, 0, height - 1);
+
+	auto fetch = [&](int x, int y) {
+		const float* pixel = image + 4 * ((size_t)y * width + x);
+		return vec4(pixel[0], pixel[1], pixel[2], pixel[3]);
+	};
+	return mix(mix(fetch(x0, y0), fetch(x1, y0), t.x), mix(fetch(x0, y1), fetch(x1, y1), t.x), t.y);
+}
+
+bool TextureCubemap::LoadEquirectangular(const std::string& path, uint32_t faceSize) {
+	MappedFile source;
+	if (!source.Open(path)) {
+		std::cout << "Could not open environment map " << path << '\n';
+		return false;
+	}
+
+	char cachePath[64];
+	snprintf(cachePath, sizeof(cachePath), "cache/Environment-%016llx.BIN", (unsigned long long)HashBytes(source.GetData(), source.GetSize()));
+
+	// The cache is only good if it was made with the same face size and version, otherwise it just gets made again
+	if (cache.Open(cachePath)) {
+		EnvironmentCacheHeader header;
+		bool valid = cache.GetSize() >= sizeof(header);
+		if (valid) {
+			memcpy(&header, cache.GetData(), sizeof(header));
+			valid = header.magic == kEnvironmentCacheMagic && header.version == kEnvironmentCacheVersion && header.faceSize == faceSize && header.format == TexelFormat::RGBA32F;
+		}
+		if (valid) {
+			faces[0].ViewData(header.format, faceSize, faceSize, nullptr);
+			valid = header.faceBytes == faces[0].GetStorageSize() && cache.GetSize() >= sizeof(header) + 6 * header.faceBytes;
+		}
+
+		if (valid) {
+			for (uint32_t i = 0; i < 6; i++)
+				faces[i].ViewData(header.format, faceSize, faceSize, cache.GetData() + sizeof(header) + i * header.faceBytes);
+			return true;
+		}
+		cache.Close();
+	}
+
+	int width, height, channels;
+	float* image = stbi_loadf_from_memory(source.GetData(), (int)source.GetSize(), &width, &height, &channels, 4);
+	if (!image) {
+		std::cout << "Could not decode environment map " << path << '\n';
+		return false;
+	}
+	source.Close();
+
+	// Rows of all six faces go into one pool, which keeps every thread busy even though there are only six faces
+	std::vector<vec4> converted(6ULL * faceSize * faceSize);
+	std::atomic<uint32_t> nextRow(0);
+	std::vector<std::future<void>> tasks;
+	for (uint32_t i = 0; i < std::max(std::thread::hardware_concurrency(), 1U); i++) {
+		tasks.push_back(std::async(std::launch::async, [&]() {
+			for (uint32_t row = nextRow++; row < 6 * faceSize; row = nextRow++) {
+				uint32_t face = row / faceSize, y = row % faceSize;
+				vec4* destination = &converted[(size_t)row * faceSize];
+				for (uint32_t x = 0; x < faceSize; x++) {
+					vec3 direction = CubemapDirection(face, (vec2(x, y) + 0.5f) / (float)faceSize);
+					destination[x] = SampleEquirectangular(image, width, height, -normalize(direction));
+				}
+			}
+		}));
+	}
+	for (std::future<void>& task : tasks)
+		task.get();
+	stbi_image_free(image);
+
+	// Building the mip chains of the faces is independent too
+	tasks.clear();
+	for (uint32_t i = 0; i < 6; i++) {
+		tasks.push_back(std::async(std::launch::async, [this, &converted, faceSize, i]() {
+			faces[i].SaveData(GL_FLOAT, faceSize, faceSize, &converted[(size_t)i * faceSize * faceSize], TexelFormat::RGBA32F);
+		}));
+	}
+	for (std::future<void>& task : tasks)
+		task.get();
+
+	EnvironmentCacheHeader header = { kEnvironmentCacheMagic, kEnvironmentCacheVersion, faceSize, faces[0].format, faces[0].GetStorageSize() };
+	std::filesystem::create_directories("cache");
+	FILE* file = fopen(cachePath, "wb");
+	bool written = (file != nullptr) && fwrite(&header, sizeof(header), 1, file) == 1;
+	for (uint32_t i = 0; written && i < 6; i++)
+		written = fwrite(faces[i].GetTexels(), 1, header.faceBytes, file) == header.faceBytes;
+	if (file)
+		written &= (fclose(file) == 0);
+
+	// A half written cache would only be thrown away next time, but there is no point in leaving it around
+	if (!written) {
+		std::cout << "Could not write the environment map cache " << cachePath << '\n';
+		remove(cachePath);
+	}
+
+	return true;
+}
+
+void TextureCubemap::UploadFaces() {
+	// Every face has the same size and format, so one buffer does for all of them
+	uint32_t size = faces[0].width;
+	std::vector<uint8_t> texels((size_t)size * size * GetTexelSize(faces[0].format));
+
+	GLenum type = GL_FLOAT;
+	if (faces[0].format == TexelFormat::RGBA8)
+		type = GL_UNSIGNED_BYTE;
+	else if (faces[0].format == TexelFormat::RGBA16F)
+		type = GL_HALF_FLOAT;
+
+	CreateBinding();
+	glTexStorage2D(GL_TEXTURE_CUBE_MAP, 1, GL_RGB32F, size, size);
+	for (uint32_t i = 0; i < 6; i++) {
+		faces[i].CopyLevel(0, texels.data());
+		glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, 0, 0, size, size, GL_RGBA, type, texels.data());
+	}
+}
+
 vec3 TextureCubemap::Sample(vec3 texcoords) const {
 	// Taken from wikipedia https://en.wikipedia.org/wiki/Cube_mapping#Memory_addressing
 	texcoords.y = -texcoords.y;
@@ -352,9 +846,24 @@ vec3 TextureCubemap::Sample(vec3 texcoords) const {
 	uv.x = 0.5f * (uc / maxAxis + 1.0f);
 	uv.y = 0.5f * (vc / maxAxis + 1.0f);
 
+	// Keep bilinear filtering from wrapping around to the opposite edge of the face, since the neighbouring texels are really on another face
+	float border = 0.5f / faces[index].width;
+	uv = clamp(uv, vec2(border), vec2(1.0f - border));
+
 	return faces[index].Sample(uv);
 }
 
 Texture2D& TextureCubemap::GetFace(uint32_t i) {
 	return faces[i];
+}
+
+uint64_t TextureCubemap::ComputeHash() const {
+	uint64_t hash = HashBytes(nullptr, 0);
+	for (const Texture2D& face : faces) {
+		hash = HashBytes((const uint8_t*)&face.format, sizeof(TexelFormat), hash);
+		hash = HashBytes((const uint8_t*)&face.width, sizeof(uint32_t), hash);
+		hash = HashBytes((const uint8_t*)&face.height, sizeof(uint32_t), hash);
+		hash = HashBytes(face.GetTexels(), face.GetStorageSize(), hash);
+	}
+	return hash;
 }
\ No newline at end of file
@@ -3,10 +3,37 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <SOIL2.h>
 #include "OpenGL.h"
+#include "../misc/MappedFile.h"
 #include <string>
+#include <vector>
 #include <glm/glm.hpp>
 using namespace glm;
 
+// How Texture2D keeps its texels around for the CPU path tracer
+enum class TexelFormat : uint32_t {
+	// Image files
+	RGBA8,
+	// Anything that came in as floats, which would get clamped as bytes. Halves top out at 65504, so brighter texels are clamped to that
+	RGBA16F,
+	// Environment maps, where an unclipped sun goes far past what a half can hold and has to stay intact for importance sampling
+	RGBA32F
+};
+
+constexpr uint32_t kMaxMipLevels = 16;
+constexpr uint32_t kTexelTileSize = 4;
+
+/*
+Every mip level is split into 4x4 tiles stored one after another in row-major order, and the texels within a tile are in Morton order
+A bilinear footprint then touches one or two tiles, which are 64 or 128 bytes, instead of two rows that are a whole image apart
+The level is padded out to a whole number of tiles, so the padding texels are never read
+*/
+struct MipLevel {
+	uint32_t width, height;
+	uint32_t tilesPerRow;
+	// In texels from the start of the storage
+	uint32_t offset;
+};
+
 class Texture {
 public:
 	Texture();
@@ -31,20 +58,46 @@ public:
 	void LoadTexture(const std::string& Path, int load = SOIL_LOAD_RGBA);
 	void LoadTexture(const char* Path, int load = SOIL_LOAD_RGBA);
 	void LoadData(GLenum DestinationFormat, GLenum SourceFormat, GLenum SourceType, uint32_t X, uint32_t Y, void* Data);
-	// Data formatting note: currently only RGB unsigned byte and RGBA float are supported for the source, and values are always stored as RGB
+	// Data formatting note: the source is either RGBA unsigned byte or RGBA float, and is kept as RGBA8 or RGBA16F with a full mip chain
 	void SaveData(GLenum SourceType, uint32_t X, uint32_t Y, void* Data);
+	// Same, but keeps the texels in the given format instead of the one that goes with the source
+	void SaveData(GLenum SourceType, uint32_t X, uint32_t Y, void* Data, TexelFormat Format);
+	// Samples texels laid out exactly like GetStorageSize describes that someone else owns, such as a mapped file, instead of making its own copy like SaveData
+	void ViewData(TexelFormat Format, uint32_t X, uint32_t Y, const void* Texels);
+	// Bytes taken up by every mip level, including the tile padding
+	size_t GetStorageSize() const;
+	// Writes a mip level out row by row in the format it is stored in, which is what GL wants for uploads
+	void CopyLevel(uint32_t level, void* destination) const;
 
 	void SetColor(const vec4& color);
 	void SetColor(const vec3& color);
 
+	// Bilinear filtering at the full resolution
 	vec3 Sample(const vec2 texcoords) const;
+	// Trilinear filtering, with the footprint being log2 of how wide the lookup is in texture coordinates
+	vec3 Sample(const vec2 texcoords, float footprint) const;
+	// Same as calling Sample for each lookup, but goes through 4 at a time with SSE; footprints can be null for full resolution lookups
+	void SampleMany(uint32_t count, const vec2* texcoords, const float* footprints, vec3* results) const;
 private:
+	friend class Renderer;
+	friend class TextureCubemap;
+
+	void ComputeLayout(TexelFormat Format, uint32_t X, uint32_t Y);
+	const uint8_t* GetTexels() const;
+	vec3 FetchTexel(const MipLevel& level, uint32_t x, uint32_t y) const;
+	vec3 SampleBilinear(const MipLevel& level, vec2 texcoords) const;
+	void SelectLevels(float footprint, uint32_t& fine, uint32_t& coarse, float& blend) const;
+
+	TexelFormat format;
 	uint32_t width, height;
-	union {
-		uint8_t* imagei;
-		float* imagef;
-	};
-	GLenum internalFormat;
+	uint32_t numLevels;
+	MipLevel levels[kMaxMipLevels];
+	// Turns a footprint into a mip level, it is log2 of how many texels of the full resolution level fit along a unit of texture coordinates
+	float lodBias;
+
+	std::vector<uint8_t> storage;
+	// Only set by ViewData, otherwise the texels live in storage
+	const uint8_t* view = nullptr;
 };
 
 class Buffer;
@@ -68,10 +121,19 @@ public:
 	void FreeBinding();
 
 	void LoadTexture(const std::string& path);
+	// Converts an equirectangular image into the faces on the CPU without touching GL, and caches the faces under the hash of the file
+	// Later runs map the cache and sample straight out of the mapping, so there is no conversion and no copy at all
+	bool LoadEquirectangular(const std::string& path, uint32_t faceSize);
+	// Gives the GPU the faces that LoadEquirectangular made
+	void UploadFaces();
 
 	vec3 Sample(vec3 texcoords) const;
 	Texture2D& GetFace(uint32_t i);
+	// FNV-1a over the texels of every face, for telling whether two runs saw the same environment
+	uint64_t ComputeHash() const;
 private:
 	friend class Renderer;
 	Texture2D faces[6];
+	// Holds the faces when LoadEquirectangular found them in the cache
+	MappedFile cache;
 };
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include "BlueNoise.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <future>
+#include <filesystem>
+#include <string>
+#include "../misc/TimeUtil.h"
+
+// Ulichney uses a gaussian with a sigma of 1.5, anything much larger starts producing visible structure
+constexpr float kVoidAndClusterSigma = 1.5f;
+// Fraction of pixels that are set in the initial binary pattern
+constexpr float kVoidAndClusterInitialDensity = 0.1f;
+
+constexpr uint32_t kBlueNoiseTileMask = kBlueNoiseTileSize - 1;
+static_assert((kBlueNoiseTileSize & kBlueNoiseTileMask) == 0, "The tile has to be a power of two to wrap around with a mask");
+
+/*
+Every set pixel adds a gaussian to the energy of every other pixel, wrapping around the edges of the tile
+The tightest cluster is the set pixel with the most energy, and the largest void is the empty pixel with the least
+*/
+class VoidAndClusterTile {
+public:
+    VoidAndClusterTile(const std::vector<float>& kernel) : kernel(kernel), pattern(kBlueNoiseTileArea, false), energy(kBlueNoiseTileArea, 0.0f), numSet(0) {}
+
+    void Set(uint32_t pixel, bool value) {
+        pattern[pixel] = value;
+        numSet += (value ? 1 : -1);
+
+        // Splitting every row into two runs lets the compiler vectorize this, which is where nearly all of the time goes
+        float sign = (value ? 1.0f : -1.0f);
+        uint32_t px = pixel % kBlueNoiseTileSize, py = pixel / kBlueNoiseTileSize;
+        for (uint32_t y = 0; y < kBlueNoiseTileSize; y++) {
+            const float* row = &kernel[((y - py) & kBlueNoiseTileMask) * kBlueNoiseTileSize];
+            float* dst = &energy[y * kBlueNoiseTileSize];
+            for (uint32_t x = 0; x < px; x++) {
+                dst[x] += sign * row[x + kBlueNoiseTileSize - px];
+            }
+            for (uint32_t x = px; x < kBlueNoiseTileSize; x++) {
+                dst[x] += sign * row[x - px];
+            }
+        }
+    }
+
+    uint32_t TightestCluster(void) const {
+        uint32_t best = 0;
+        float bestEnergy = -INFINITY;
+        for (uint32_t i = 0; i < kBlueNoiseTileArea; i++) {
+            if (pattern[i] && energy[i] > bestEnergy) {
+                bestEnergy = energy[i];
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    uint32_t LargestVoid(void) const {
+        uint32_t best = 0;
+        float bestEnergy = INFINITY;
+        for (uint32_t i = 0; i < kBlueNoiseTileArea; i++) {
+            if (!pattern[i] && energy[i] < bestEnergy) {
+                bestEnergy = energy[i];
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    bool IsSet(uint32_t pixel) const {
+        return pattern[pixel];
+    }
+
+    uint32_t GetNumSet(void) const {
+        return numSet;
+    }
+private:
+    const std::vector<float>& kernel;
+    std::vector<bool> pattern;
+    std::vector<float> energy;
+    uint32_t numSet;
+};
+
+std::vector<uint16_t> GenerateBlueNoiseTile(uint32_t seed) {
+    std::vector<float> kernel(kBlueNoiseTileArea);
+    for (uint32_t y = 0; y < kBlueNoiseTileSize; y++) {
+        for (uint32_t x = 0; x < kBlueNoiseTileSize; x++) {
+            // Shortest distance on the torus
+            float dx = (float)std::min(x, kBlueNoiseTileSize - x);
+            float dy = (float)std::min(y, kBlueNoiseTileSize - y);
+            kernel[y * kBlueNoiseTileSize + x] = expf(-(dx * dx + dy * dy) / (2.0f * kVoidAndClusterSigma * kVoidAndClusterSigma));
+        }
+    }
+
+    // Start with white noise, and move the tightest cluster into the largest void until it is already there
+    VoidAndClusterTile prototype(kernel);
+    std::mt19937 generator(seed);
+    std::uniform_int_distribution<uint32_t> pixelDistribution(0, kBlueNoiseTileArea - 1);
+    while (prototype.GetNumSet() < (uint32_t)(kVoidAndClusterInitialDensity * kBlueNoiseTileArea)) {
+        uint32_t pixel = pixelDistribution(generator);
+        if (!prototype.IsSet(pixel)) {
+            prototype.Set(pixel, true);
+        }
+    }
+
+    while (true) {
+        uint32_t cluster = prototype.TightestCluster();
+        prototype.Set(cluster, false);
+        uint32_t gap = prototype.LargestVoid();
+        prototype.Set(gap, true);
+        if (gap == cluster) {
+            break;
+        }
+    }
+
+    std::vector<uint16_t> ranks(kBlueNoiseTileArea);
+
+    // Phase 1: remove the tightest clusters of the prototype, which gives them the ranks below the prototype's size
+    VoidAndClusterTile removal = prototype;
+    while (removal.GetNumSet() > 0) {
+        uint32_t cluster = removal.TightestCluster();
+        removal.Set(cluster, false);
+        ranks[cluster] = (uint16_t)removal.GetNumSet();
+    }
+
+    /*
+    Phases 2 and 3: fill the largest voids of the prototype until every pixel is set
+    Ulichney switches to finding the tightest cluster of empty pixels once the tile is half full, but since the kernel sums to the same value everywhere
+    that is the empty pixel with the least energy from the set ones, which is exactly the largest void
+    */
+    VoidAndClusterTile insertion = prototype;
+    while (insertion.GetNumSet() < kBlueNoiseTileArea) {
+        uint32_t gap = insertion.LargestVoid();
+        ranks[gap] = (uint16_t)insertion.GetNumSet();
+        insertion.Set(gap, true);
+    }
+
+    return ranks;
+}
+
+std::vector<uint16_t> LoadBlueNoiseTiles(void) {
+    std::vector<uint16_t> tiles(kBlueNoiseDimensions * kBlueNoiseTileArea);
+
+    // Same layout as the texture cache, the size of the data goes first so that we can tell when the constants change
+    std::string cachedPath = "cache/BlueNoise.BIN";
+    uint32_t metaData[] = { kBlueNoiseTileSize, kBlueNoiseDimensions };
+
+    FILE* cacheRead = fopen(cachedPath.c_str(), "rb");
+    if (cacheRead) {
+        uint32_t cachedMetaData[2];
+        bool valid =
+            fread(cachedMetaData, sizeof(cachedMetaData), 1, cacheRead) == 1 &&
+            cachedMetaData[0] == metaData[0] && cachedMetaData[1] == metaData[1] &&
+            fread(tiles.data(), sizeof(uint16_t), tiles.size(), cacheRead) == tiles.size();
+        fclose(cacheRead);
+
+        if (valid) {
+            return tiles;
+        }
+    }
+
+    Timer generationTimer;
+    generationTimer.Begin();
+
+    std::vector<std::future<std::vector<uint16_t>>> tasks;
+    for (uint32_t i = 0; i < kBlueNoiseDimensions; i++) {
+        tasks.push_back(std::async(std::launch::async, GenerateBlueNoiseTile, 0x9E3779B9U * (i + 1)));
+    }
+    for (uint32_t i = 0; i < kBlueNoiseDimensions; i++) {
+        std::vector<uint16_t> tile = tasks[i].get();
+        std::copy(tile.begin(), tile.end(), tiles.begin() + i * kBlueNoiseTileArea);
+    }
+
+    generationTimer.End();
+    std::cout << "Generated " << kBlueNoiseDimensions << " blue noise tiles in " << generationTimer.Delta << " seconds\n";
+
+    std::filesystem::create_directories(cachedPath.substr(0, cachedPath.rfind('/')));
+    FILE* createCache = fopen(cachedPath.c_str(), "wb");
+    if (createCache) {
+        fwrite(metaData, sizeof(metaData), 1, createCache);
+        fwrite(tiles.data(), sizeof(uint16_t), tiles.size(), createCache);
+        fclose(createCache);
+    }
+
+    return tiles;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+// Tiles are square and wrap around the screen, 128x128 is what most papers settle on
+constexpr uint32_t kBlueNoiseTileSize = 128;
+constexpr uint32_t kBlueNoiseTileArea = kBlueNoiseTileSize * kBlueNoiseTileSize;
+// One tile per random dimension, which covers the camera ray and the first bounce of Iterative.comp
+constexpr uint32_t kBlueNoiseDimensions = 8;
+
+/*
+Ranks every pixel of a toroidal tile with void-and-cluster [Ulichney 1993], so that the pixels of any rank range are spread out evenly
+Ranks go from 0 to kBlueNoiseTileArea - 1, and the tile is stored row by row
+*/
+std::vector<uint16_t> GenerateBlueNoiseTile(uint32_t seed);
+
+/*
+Returns the tiles of all kBlueNoiseDimensions dimensions back to back, loading them from the cache if we generated them before
+Otherwise each tile is generated on its own thread and the result is written to the cache for the next startup
+*/
+std::vector<uint16_t> LoadBlueNoiseTiles(void);
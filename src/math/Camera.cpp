@@ -66,4 +66,8 @@ Ray Camera::GenRay(vec2 interpolation, float random0, float random1) const {
 	ray.origin = position + offset;
 	ray.direction = normalize(lower_left + interpolation.x * horizontal + interpolation.y * vertical - offset);
 	return ray;
-}
\ No newline at end of file
+}
+
+float Camera::GetPixelSpreadAngle(uint32_t imageHeight) const {
+	return atan(2.0f * tan(fov / 2) / imageHeight);
+}
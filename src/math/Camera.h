@@ -29,6 +29,8 @@ public:
 
 	void Move(float Distance);
 	Ray GenRay(vec2 interpolation, float random0, float random1) const;
+	// Angle that a single pixel covers, which is how fast the ray cones used for texture filtering grow
+	float GetPixelSpreadAngle(uint32_t imageHeight) const;
 private: 
 	vec3 position;
 	vec3 direction;
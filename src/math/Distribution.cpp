@@ -0,0 +1,104 @@
+#include "Distribution.h"
+
+#include <algorithm>
+#include <future>
+#include <thread>
+
+// Finds the cell a random number lands in and how far into the cell it is
+uint32_t SampleCdf(const float* cdf, uint32_t count, float u, float& remainder) {
+    // The last entry is always 1, so only the first count entries are searched and the result is always a valid cell
+    uint32_t cell = (uint32_t)(std::upper_bound(cdf, cdf + count, u) - cdf);
+    cell = (cell > 0 ? cell - 1 : 0);
+
+    float width = cdf[cell + 1] - cdf[cell];
+    remainder = (width > 0.0f ? (u - cdf[cell]) / width : 0.5f);
+    remainder = std::min(std::max(remainder, 0.0f), 0.99999994f);
+    return cell;
+}
+
+// Cell that a coordinate in [0, 1) falls in, where anything outside (NaN included) goes to the closest cell instead
+uint32_t FindCell(float coordinate, uint32_t count) {
+    float scaled = coordinate * count;
+    if (!(scaled > 0.0f))
+        return 0;
+    return (scaled < (float)count ? std::min((uint32_t)scaled, count - 1) : count - 1);
+}
+
+// Turns sums into a CDF in place, or a uniform one if everything is 0 so that no cell has a width of 0 to divide by
+void NormalizeCdf(float* cdf, uint32_t count, double total) {
+    for (uint32_t i = 1; i <= count; i++)
+        cdf[i] = (total > 0.0 ? (float)(cdf[i] / total) : (float)i / count);
+    cdf[0] = 0.0f;
+    cdf[count] = 1.0f;
+}
+
+Distribution2D::Distribution2D(void) : width(0), height(0), empty(true) {}
+
+void Distribution2D::Build(uint32_t newWidth, uint32_t newHeight, const std::function<float(uint32_t x, uint32_t y)>& weight) {
+    width = newWidth;
+    height = newHeight;
+    density.resize((size_t)width * height);
+    conditionalCdfs.resize((size_t)(width + 1) * height);
+    std::vector<double> rowSums(height);
+
+    // Every row only depends on its own weights, so threads take a block of rows each
+    uint32_t numThreads = std::max(std::thread::hardware_concurrency(), 1U);
+    uint32_t rowsPerThread = (height + numThreads - 1) / numThreads;
+    std::vector<std::future<void>> tasks;
+    for (uint32_t begin = 0; begin < height; begin += rowsPerThread) {
+        uint32_t end = std::min(begin + rowsPerThread, height);
+        tasks.push_back(std::async(std::launch::async, [&, begin, end]() {
+            for (uint32_t y = begin; y < end; y++) {
+                float* values = &density[(size_t)y * width];
+                float* cdf = &conditionalCdfs[(size_t)y * (width + 1)];
+
+                // Summed in double since a bright sun next to a dim sky would otherwise lose the sky entirely
+                double sum = 0.0;
+                cdf[0] = 0.0f;
+                for (uint32_t x = 0; x < width; x++) {
+                    values[x] = weight(x, y);
+                    sum += values[x];
+                    cdf[x + 1] = (float)sum;
+                }
+
+                NormalizeCdf(cdf, width, sum);
+                rowSums[y] = sum;
+            }
+        }));
+    }
+    for (std::future<void>& task : tasks)
+        task.get();
+
+    double total = 0.0;
+    marginalCdf.resize(height + 1);
+    for (uint32_t y = 0; y < height; y++) {
+        total += rowSums[y];
+        marginalCdf[y + 1] = (float)total;
+    }
+    NormalizeCdf(marginalCdf.data(), height, total);
+    empty = !(total > 0.0);
+
+    // The density of a cell is its share of the total divided by its share of the area
+    float scale = (total > 0.0 ? (float)((double)width * height / total) : 0.0f);
+    for (float& value : density)
+        value *= scale;
+}
+
+bool Distribution2D::IsEmpty(void) const {
+    return empty;
+}
+
+vec2 Distribution2D::Sample(float u0, float u1, float& pdf) const {
+    vec2 remainder;
+    uint32_t y = SampleCdf(marginalCdf.data(), height, u1, remainder.y);
+    uint32_t x = SampleCdf(&conditionalCdfs[(size_t)y * (width + 1)], width, u0, remainder.x);
+
+    pdf = density[(size_t)y * width + x];
+    return (vec2(x, y) + remainder) / vec2(width, height);
+}
+
+float Distribution2D::Pdf(vec2 point) const {
+    if (empty)
+        return 0.0f;
+    return density[(size_t)FindCell(point.y, height) * width + FindCell(point.x, width)];
+}
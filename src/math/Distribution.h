@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <functional>
+#include <glm/glm.hpp>
+
+using namespace glm;
+
+/*
+Piecewise constant 2D distribution over [0, 1)^2, split into width x height cells [Pharr et al. 2016, section 13.6.7]
+A sample first picks a row with the marginal CDF and then a column with the conditional CDF of that row, and the leftover
+of each random number places it within the cell, so stratified random numbers stay stratified
+*/
+class Distribution2D {
+public:
+	Distribution2D(void);
+
+	// Weights have to be finite and at least 0. Rows are evaluated and summed on several threads, so weight has to be safe to call from any of them
+	void Build(uint32_t width, uint32_t height, const std::function<float(uint32_t x, uint32_t y)>& weight);
+	// True until Build is called with weights that are not all 0, since then there is nothing to sample
+	bool IsEmpty(void) const;
+
+	// Density is with respect to area in [0, 1)^2
+	vec2 Sample(float u0, float u1, float& pdf) const;
+	float Pdf(vec2 point) const;
+private:
+	uint32_t width, height;
+	// Weights divided by their average, so that they are the density of each cell
+	std::vector<float> density;
+	// width + 1 entries per row, starting at 0 and ending at 1
+	std::vector<float> conditionalCdfs;
+	std::vector<float> marginalCdf;
+	bool empty;
+};
@@ -0,0 +1,77 @@
+#include "Half.h"
+#include <string.h>
+
+uint16_t FloatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    uint32_t magnitude = bits & 0x7FFFFFFF;
+
+    // NaN stays NaN, infinity and anything that rounds past 65504 become infinity
+    if (magnitude > 0x7F800000)
+        return sign | 0x7E00;
+    if (magnitude >= 0x477FF000)
+        return sign | 0x7C00;
+
+    // Too small to be a normal half, so it becomes a denormal with the implicit one shifted into the mantissa
+    if (magnitude < 0x38800000) {
+        if (magnitude < 0x33000000)
+            return sign;
+
+        uint32_t mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+        uint32_t shift = 126 - (magnitude >> 23);
+        uint32_t result = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1U << shift) - 1);
+        uint32_t halfway = 1U << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (result & 1)))
+            result++;
+        return sign | (uint16_t)result;
+    }
+
+    // Rebias the exponent from 127 to 15, a carry out of the mantissa correctly bumps the exponent
+    uint32_t result = (magnitude - 0x38000000) >> 13;
+    uint32_t remainder = magnitude & 0x1FFF;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (result & 1)))
+        result++;
+    return sign | (uint16_t)result;
+}
+
+/*
+Shifting the exponent and mantissa into place gives a float that is off by the difference in exponent bias, which a multiply by 2^112 fixes
+The multiply also turns half denormals into normal floats for free, and only infinity and NaN need their exponent patched [Giesen 2012]
+*/
+float HalfToFloat(uint16_t value) {
+    const uint32_t kMagicBits = (254 - 15) << 23;
+    float magic;
+    memcpy(&magic, &kMagicBits, sizeof(magic));
+
+    uint32_t bits = (uint32_t)(value & 0x7FFF) << 13;
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    result *= magic;
+
+    memcpy(&bits, &result, sizeof(bits));
+    if ((value & 0x7C00) == 0x7C00)
+        bits |= 255 << 23;
+    bits |= (uint32_t)(value & 0x8000) << 16;
+
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+#ifdef SIMD_SSE2
+__m128 HalfToFloat4(__m128i value) {
+    const __m128i magnitudeMask = _mm_set1_epi32(0x7FFF);
+    const __m128i magic = _mm_set1_epi32((254 - 15) << 23);
+    const __m128i largestFinite = _mm_set1_epi32(0x7BFF);
+    const __m128i infinityExponent = _mm_set1_epi32(255 << 23);
+
+    __m128i magnitude = _mm_and_si128(value, magnitudeMask);
+    __m128i sign = _mm_slli_epi32(_mm_xor_si128(_mm_and_si128(value, _mm_set1_epi32(0xFFFF)), magnitude), 16);
+    __m128 scaled = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(magnitude, 13)), _mm_castsi128_ps(magic));
+
+    __m128i infinityOrNaN = _mm_and_si128(_mm_cmpgt_epi32(magnitude, largestFinite), infinityExponent);
+    return _mm_or_ps(scaled, _mm_castsi128_ps(_mm_or_si128(sign, infinityOrNaN)));
+}
+#endif
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include "SIMD.h"
+
+// Largest finite half
+constexpr float kMaxHalf = 65504.0f;
+
+// Rounds to the nearest half, ties to even, with everything above 65504 turning into infinity
+uint16_t FloatToHalf(float value);
+
+// Exact, since every half is also a float
+float HalfToFloat(uint16_t value);
+
+#ifdef SIMD_SSE2
+// Same as HalfToFloat, for four halves sitting in the low 16 bits of each lane, the high 16 bits are ignored
+__m128 HalfToFloat4(__m128i value);
+#endif
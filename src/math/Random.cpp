@@ -0,0 +1,475 @@
+#include "Random.h"
+#include "SIMD.h"
+
+using namespace glm;
+
+// Shifts and masks of the three Tausworthe components of HybridTaus, followed by the LCG that makes up the fourth
+constexpr int kTausShifts[3][3] = { { 13, 19, 12 }, { 2, 25, 4 }, { 3, 11, 17 } };
+constexpr uint32_t kTausMasks[3] = { 4294967294U, 4294967288U, 4294967280U };
+constexpr uint32_t kTausLCGMultiplier = 1664525;
+constexpr uint32_t kTausLCGIncrement = 1013904223U;
+
+constexpr uint64_t kPCGMultiplier = 6364136223846793005ULL;
+
+// Primitive polynomials and initial direction numbers of Sobol dimensions 2 to 4 [Joe and Kuo 2008], the first dimension is van der Corput
+constexpr uint32_t kSobolDegrees[3] = { 1, 2, 3 };
+constexpr uint32_t kSobolCoefficients[3] = { 0, 1, 1 };
+constexpr uint32_t kSobolInitialDirections[3][3] = { { 1 }, { 1, 3 }, { 1, 3, 1 } };
+
+constexpr uint32_t kPhiloxMultipliers[2] = { 0xD2511F53, 0xCD9E8D57 };
+constexpr uint32_t kPhiloxWeyl[2] = { 0x9E3779B9, 0xBB67AE85 };
+constexpr int kPhiloxRounds = 10;
+
+uint32_t TausStep(uint32_t& z, uint32_t s1, uint32_t s2, uint32_t s3, uint32_t m) {
+    uint b = (((z << s1) ^ z) >> s2);
+    z = (((z & m) << s3) ^ b);
+    return z;
+}
+
+uint32_t LCGStep(uint32_t& z, uint32_t a, uint32_t c) {
+    z = a * z + c;
+    return z;
+}
+
+float HybridTaus(uvec4& state) {
+    return 2.3283064365387e-10f * float(
+        TausStep(state.x, 13, 19, 12, 4294967294U) ^
+        TausStep(state.y, 2, 25, 4, 4294967288U) ^
+        TausStep(state.z, 3, 11, 17, 4294967280U) ^
+        LCGStep(state.w, 1664525, 1013904223U)
+    );
+}
+
+// Used to turn a key into starting states, see https://prng.di.unimi.it/splitmix64.c
+uint64_t SplitMix64(uint64_t& state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Top 24 bits so that we never round up to 1
+inline float UintToUnitFloat(uint32_t u) {
+    return (float)(u >> 8) * (1.0f / 16777216.0f);
+}
+
+// Jumps an LCG ahead by n steps in O(log n) [Brown 1994, "Random Number Generation with Arbitrary Strides"]
+template<typename T>
+T JumpLCG(T state, T multiplier, T increment, uint64_t n) {
+    T accumulatedMultiplier = 1;
+    T accumulatedIncrement = 0;
+    while (n) {
+        if (n & 1) {
+            accumulatedMultiplier *= multiplier;
+            accumulatedIncrement = accumulatedIncrement * multiplier + increment;
+        }
+        increment = (multiplier + 1) * increment;
+        multiplier *= multiplier;
+        n >>= 1;
+    }
+    return accumulatedMultiplier * state + accumulatedIncrement;
+}
+
+// A GF(2) matrix stored as its 32 columns, so multiplying a vector just xors together the columns of its set bits
+uint32_t MultiplyBitMatrix(const uint32_t* columns, uint32_t v) {
+    // Masking instead of branching lets the compiler vectorize this, and the bits are random anyway
+    uint32_t result = 0;
+    for (int j = 0; j < 32; j++) {
+        result ^= columns[j] & (0U - ((v >> j) & 1));
+    }
+    return result;
+}
+
+// columns[c][k] is the step matrix of Tausworthe component c raised to the power 2^k
+struct TausJumpTable {
+    uint32_t columns[3][64][32];
+
+    TausJumpTable(void) {
+        for (int c = 0; c < 3; c++) {
+            // A step is only shifts, ands, and xors, so stepping each basis vector gives us the columns
+            for (int j = 0; j < 32; j++) {
+                uint32_t z = 1U << j;
+                columns[c][0][j] = TausStep(z, kTausShifts[c][0], kTausShifts[c][1], kTausShifts[c][2], kTausMasks[c]);
+            }
+
+            for (int k = 1; k < 64; k++) {
+                for (int j = 0; j < 32; j++) {
+                    columns[c][k][j] = MultiplyBitMatrix(columns[c][k - 1], columns[c][k - 1][j]);
+                }
+            }
+        }
+    }
+};
+
+const TausJumpTable& GetTausJumpTable(void) {
+    static TausJumpTable table;
+    return table;
+}
+
+void JumpTaus(uint32_t state[4], uint64_t n) {
+    const TausJumpTable& table = GetTausJumpTable();
+    for (int k = 0; k < 64; k++) {
+        if (n & (1ULL << k)) {
+            for (int c = 0; c < 3; c++)
+                state[c] = MultiplyBitMatrix(table.columns[c][k], state[c]);
+        }
+    }
+    state[3] = JumpLCG<uint32_t>(state[3], kTausLCGMultiplier, kTausLCGIncrement, n);
+}
+
+uint32_t PCG32Step(uint64_t& state, uint64_t increment) {
+    uint64_t old = state;
+    state = old * kPCGMultiplier + increment;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+void Philox4x32(uint32_t counter[4], uint32_t key0, uint32_t key1) {
+    for (int round = 0; round < kPhiloxRounds; round++) {
+        if (round != 0) {
+            key0 += kPhiloxWeyl[0];
+            key1 += kPhiloxWeyl[1];
+        }
+
+        uint64_t product0 = (uint64_t)kPhiloxMultipliers[0] * counter[0];
+        uint64_t product1 = (uint64_t)kPhiloxMultipliers[1] * counter[2];
+
+        uint32_t next[4] = {
+            (uint32_t)(product1 >> 32) ^ counter[1] ^ key0,
+            (uint32_t)product1,
+            (uint32_t)(product0 >> 32) ^ counter[3] ^ key1,
+            (uint32_t)product0
+        };
+
+        for (int i = 0; i < 4; i++)
+            counter[i] = next[i];
+    }
+}
+
+RandomStreams8::RandomStreams8(RandomGenerator generator, uint64_t key) : generator(generator), key(key), pcgIncrement((key << 1) | 1) {
+    SkipTo(0);
+}
+
+void RandomStreams8::SkipTo(uint64_t sample) {
+    firstSample = sample;
+
+    uint64_t seed = key;
+    switch (generator) {
+    case RandomGenerator::HYBRID_TAUS: {
+        // Each Tausworthe component degenerates if the bits it keeps are all zero, so we make sure there are set bits above the mask
+        uint32_t base[4];
+        for (int c = 0; c < 4; c++) {
+            base[c] = (uint32_t)SplitMix64(seed);
+            if (base[c] < 128)
+                base[c] += 128;
+        }
+
+        for (uint32_t lane = 0; lane < kRandomLanes; lane++) {
+            uint32_t state[4] = { base[0], base[1], base[2], base[3] };
+            JumpTaus(state, (sample + lane) * kRandomDimensionsPerSample);
+            for (int c = 0; c < 4; c++)
+                taus[c][lane] = state[c];
+        }
+        break;
+    }
+    case RandomGenerator::PCG32: {
+        // Seeding as in pcg32_srandom_r
+        uint64_t base = 0;
+        PCG32Step(base, pcgIncrement);
+        base += SplitMix64(seed);
+        PCG32Step(base, pcgIncrement);
+
+        for (uint32_t lane = 0; lane < kRandomLanes; lane++) {
+            pcg[lane] = JumpLCG<uint64_t>(base, kPCGMultiplier, pcgIncrement, (sample + lane) * kRandomDimensionsPerSample);
+        }
+        break;
+    }
+    case RandomGenerator::PHILOX:
+        break;
+    }
+}
+
+void RandomStreams8::NextSamples(void) {
+    firstSample += kRandomLanes;
+
+    constexpr uint64_t kJump = (uint64_t)kRandomLanes * kRandomDimensionsPerSample;
+    switch (generator) {
+    case RandomGenerator::HYBRID_TAUS:
+        for (uint32_t lane = 0; lane < kRandomLanes; lane++) {
+            uint32_t state[4] = { taus[0][lane], taus[1][lane], taus[2][lane], taus[3][lane] };
+            JumpTaus(state, kJump);
+            for (int c = 0; c < 4; c++)
+                taus[c][lane] = state[c];
+        }
+        break;
+    case RandomGenerator::PCG32:
+        for (uint32_t lane = 0; lane < kRandomLanes; lane++) {
+            pcg[lane] = JumpLCG<uint64_t>(pcg[lane], kPCGMultiplier, pcgIncrement, kJump);
+        }
+        break;
+    case RandomGenerator::PHILOX:
+        break;
+    }
+}
+
+uint64_t RandomStreams8::GetFirstSample(void) const {
+    return firstSample;
+}
+
+#ifdef SIMD_AVX2
+inline __m256i TausStep8(__m256i z, int s1, int s2, int s3, uint32_t m) {
+    __m256i b = _mm256_srli_epi32(_mm256_xor_si256(_mm256_slli_epi32(z, s1), z), s2);
+    return _mm256_xor_si256(_mm256_slli_epi32(_mm256_and_si256(z, _mm256_set1_epi32((int)m)), s3), b);
+}
+
+// There is no unsigned conversion before AVX-512, but both halves fit in a float exactly, so adding them only rounds once like float(u) does
+inline __m256 HybridTausToFloat8(__m256i u) {
+    __m256 high = _mm256_cvtepi32_ps(_mm256_srli_epi32(u, 16));
+    __m256 low = _mm256_cvtepi32_ps(_mm256_and_si256(u, _mm256_set1_epi32(0xFFFF)));
+    __m256 value = _mm256_add_ps(_mm256_mul_ps(high, _mm256_set1_ps(65536.0f)), low);
+    return _mm256_mul_ps(value, _mm256_set1_ps(2.3283064365387e-10f));
+}
+
+inline __m256 UintToUnitFloat8(__m256i u) {
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(u, 8)), _mm256_set1_ps(1.0f / 16777216.0f));
+}
+
+// AVX2 only multiplies 32 bit halves, so we build the low 64 bits of the product out of three of them
+inline __m256i Multiply64(__m256i a, __m256i b) {
+    __m256i low = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b), _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+// Four PCG32 outputs, each in the low half of its 64 bit lane
+inline __m256i PCG32Step4(__m256i& state, __m256i multiplier, __m256i increment) {
+    __m256i old = state;
+    state = _mm256_add_epi64(Multiply64(old, multiplier), increment);
+
+    __m256i xorshifted = _mm256_and_si256(_mm256_srli_epi64(_mm256_xor_si256(_mm256_srli_epi64(old, 18), old), 27), _mm256_set1_epi64x(0xFFFFFFFF));
+    __m256i rot = _mm256_srli_epi64(old, 59);
+
+    // The bits shifted past the low half are thrown away later, which turns the two shifts into a rotate
+    return _mm256_or_si256(_mm256_srlv_epi64(xorshifted, rot), _mm256_sllv_epi64(xorshifted, _mm256_sub_epi64(_mm256_set1_epi64x(32), rot)));
+}
+
+// Multiplies every lane by m and splits the 64 bit products into high and low halves
+inline void MultiplyHighLow8(__m256i a, uint32_t m, __m256i& high, __m256i& low) {
+    __m256i multiplier = _mm256_set1_epi32((int)m);
+    __m256i even = _mm256_mul_epu32(a, multiplier);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), multiplier);
+
+    low = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    high = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+#endif
+
+void RandomStreams8::Fill(float* out, uint32_t firstDimension, uint32_t count) const {
+    switch (generator) {
+    case RandomGenerator::HYBRID_TAUS: {
+        alignas(32) uint32_t state[4][kRandomLanes];
+        for (uint32_t lane = 0; lane < kRandomLanes; lane++) {
+            uint32_t laneState[4] = { taus[0][lane], taus[1][lane], taus[2][lane], taus[3][lane] };
+            if (firstDimension != 0)
+                JumpTaus(laneState, firstDimension);
+            for (int c = 0; c < 4; c++)
+                state[c][lane] = laneState[c];
+        }
+
+#ifdef SIMD_AVX2
+        __m256i z0 = _mm256_load_si256((const __m256i*)state[0]);
+        __m256i z1 = _mm256_load_si256((const __m256i*)state[1]);
+        __m256i z2 = _mm256_load_si256((const __m256i*)state[2]);
+        __m256i z3 = _mm256_load_si256((const __m256i*)state[3]);
+        const __m256i multiplier = _mm256_set1_epi32((int)kTausLCGMultiplier);
+        const __m256i increment = _mm256_set1_epi32((int)kTausLCGIncrement);
+        for (uint32_t i = 0; i < count; i++) {
+            z0 = TausStep8(z0, kTausShifts[0][0], kTausShifts[0][1], kTausShifts[0][2], kTausMasks[0]);
+            z1 = TausStep8(z1, kTausShifts[1][0], kTausShifts[1][1], kTausShifts[1][2], kTausMasks[1]);
+            z2 = TausStep8(z2, kTausShifts[2][0], kTausShifts[2][1], kTausShifts[2][2], kTausMasks[2]);
+            z3 = _mm256_add_epi32(_mm256_mullo_epi32(z3, multiplier), increment);
+
+            __m256i u = _mm256_xor_si256(_mm256_xor_si256(z0, z1), _mm256_xor_si256(z2, z3));
+            _mm256_storeu_ps(out + kRandomLanes * i, HybridTausToFloat8(u));
+        }
+#else
+        for (uint32_t lane = 0; lane < kRandomLanes; lane++) {
+            uvec4 laneState(state[0][lane], state[1][lane], state[2][lane], state[3][lane]);
+            for (uint32_t i = 0; i < count; i++)
+                out[kRandomLanes * i + lane] = HybridTaus(laneState);
+        }
+#endif
+        break;
+    }
+    case RandomGenerator::PCG32: {
+        alignas(32) uint64_t state[kRandomLanes];
+        for (uint32_t lane = 0; lane < kRandomLanes; lane++)
+            state[lane] = (firstDimension != 0 ? JumpLCG<uint64_t>(pcg[lane], kPCGMultiplier, pcgIncrement, firstDimension) : pcg[lane]);
+
+#ifdef SIMD_AVX2
+        __m256i stateLow = _mm256_load_si256((const __m256i*)state);
+        __m256i stateHigh = _mm256_load_si256((const __m256i*)(state + 4));
+        const __m256i multiplier = _mm256_set1_epi64x((long long)kPCGMultiplier);
+        const __m256i increment = _mm256_set1_epi64x((long long)pcgIncrement);
+        // Gathers the low halves of the four 64 bit lanes into the lower 128 bits
+        const __m256i gather = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+        for (uint32_t i = 0; i < count; i++) {
+            __m256i low = _mm256_permutevar8x32_epi32(PCG32Step4(stateLow, multiplier, increment), gather);
+            __m256i high = _mm256_permutevar8x32_epi32(PCG32Step4(stateHigh, multiplier, increment), gather);
+            _mm256_storeu_ps(out + kRandomLanes * i, UintToUnitFloat8(_mm256_permute2x128_si256(low, high, 0x20)));
+        }
+#else
+        for (uint32_t lane = 0; lane < kRandomLanes; lane++) {
+            for (uint32_t i = 0; i < count; i++)
+                out[kRandomLanes * i + lane] = UintToUnitFloat(PCG32Step(state[lane], pcgIncrement));
+        }
+#endif
+        break;
+    }
+    case RandomGenerator::PHILOX: {
+        // Every counter gives four numbers: (dimension / 4, sample low, sample high, 0) and we pick out dimension % 4
+        uint32_t key0 = (uint32_t)key;
+        uint32_t key1 = (uint32_t)(key >> 32);
+        uint32_t end = firstDimension + count;
+
+#ifdef SIMD_AVX2
+        alignas(32) uint32_t sampleLow[kRandomLanes], sampleHigh[kRandomLanes];
+        for (uint32_t lane = 0; lane < kRandomLanes; lane++) {
+            sampleLow[lane] = (uint32_t)(firstSample + lane);
+            sampleHigh[lane] = (uint32_t)((firstSample + lane) >> 32);
+        }
+
+        for (uint32_t block = firstDimension / 4; 4 * block < end; block++) {
+            __m256i counter[4] = {
+                _mm256_set1_epi32((int)block),
+                _mm256_load_si256((const __m256i*)sampleLow),
+                _mm256_load_si256((const __m256i*)sampleHigh),
+                _mm256_setzero_si256()
+            };
+
+            __m256i roundKey0 = _mm256_set1_epi32((int)key0);
+            __m256i roundKey1 = _mm256_set1_epi32((int)key1);
+            for (int round = 0; round < kPhiloxRounds; round++) {
+                if (round != 0) {
+                    roundKey0 = _mm256_add_epi32(roundKey0, _mm256_set1_epi32((int)kPhiloxWeyl[0]));
+                    roundKey1 = _mm256_add_epi32(roundKey1, _mm256_set1_epi32((int)kPhiloxWeyl[1]));
+                }
+
+                __m256i high0, low0, high1, low1;
+                MultiplyHighLow8(counter[0], kPhiloxMultipliers[0], high0, low0);
+                MultiplyHighLow8(counter[2], kPhiloxMultipliers[1], high1, low1);
+
+                counter[0] = _mm256_xor_si256(_mm256_xor_si256(high1, counter[1]), roundKey0);
+                counter[1] = low1;
+                counter[2] = _mm256_xor_si256(_mm256_xor_si256(high0, counter[3]), roundKey1);
+                counter[3] = low0;
+            }
+
+            for (uint32_t word = 0; word < 4; word++) {
+                uint32_t dimension = 4 * block + word;
+                if (dimension >= firstDimension && dimension < end)
+                    _mm256_storeu_ps(out + kRandomLanes * (dimension - firstDimension), UintToUnitFloat8(counter[word]));
+            }
+        }
+#else
+        for (uint32_t lane = 0; lane < kRandomLanes; lane++) {
+            uint64_t sample = firstSample + lane;
+            for (uint32_t block = firstDimension / 4; 4 * block < end; block++) {
+                uint32_t counter[4] = { block, (uint32_t)sample, (uint32_t)(sample >> 32), 0 };
+                Philox4x32(counter, key0, key1);
+
+                for (uint32_t word = 0; word < 4; word++) {
+                    uint32_t dimension = 4 * block + word;
+                    if (dimension >= firstDimension && dimension < end)
+                        out[kRandomLanes * (dimension - firstDimension) + lane] = UintToUnitFloat(counter[word]);
+                }
+            }
+        }
+#endif
+        break;
+    }
+    }
+}
+
+struct SobolDirections {
+    uint32_t directions[4][32];
+
+    SobolDirections(void) {
+        for (int k = 0; k < 32; k++)
+            directions[0][k] = 1U << (31 - k);
+
+        for (int d = 1; d < 4; d++) {
+            uint32_t s = kSobolDegrees[d - 1];
+            uint32_t a = kSobolCoefficients[d - 1];
+            uint32_t* v = directions[d];
+
+            for (uint32_t k = 0; k < s; k++)
+                v[k] = kSobolInitialDirections[d - 1][k] << (31 - k);
+
+            for (uint32_t k = s; k < 32; k++) {
+                v[k] = v[k - s] ^ (v[k - s] >> s);
+                for (uint32_t j = 1; j < s; j++) {
+                    if ((a >> (s - 1 - j)) & 1)
+                        v[k] ^= v[k - j];
+                }
+            }
+        }
+    }
+};
+
+const SobolDirections& GetSobolDirections(void) {
+    static SobolDirections table;
+    return table;
+}
+
+uint32_t ReverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+    x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// See https://nullprogram.com/blog/2018/07/31/
+uint32_t HashInteger(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    x ^= x >> 16;
+    return x;
+}
+
+uint32_t HashCombine(uint32_t seed, uint32_t value) {
+    return seed ^ (value + (seed << 6) + (seed >> 2));
+}
+
+// Owen scrambling flips each bit based on the bits above it, which Laine and Karras do with a hash whose bits only depend on the ones below, so we reverse around it
+uint32_t NestedUniformScramble(uint32_t x, uint32_t seed) {
+    x = ReverseBits(x);
+
+    x += seed;
+    x ^= x * 0x6C50B47C;
+    x ^= x * 0xB82F1E52;
+    x ^= x * 0xC7AFE638;
+    x ^= x * 0x8D22F6E6;
+
+    return ReverseBits(x);
+}
+
+float SobolOwen(uint32_t pixel, uint32_t sample, uint32_t dimension) {
+    const SobolDirections& table = GetSobolDirections();
+
+    uint32_t seed = HashCombine(HashInteger(pixel), HashInteger(dimension / 4));
+    uint32_t index = NestedUniformScramble(sample, seed);
+
+    uint32_t x = 0;
+    const uint32_t* v = table.directions[dimension % 4];
+    for (int k = 0; index; k++, index >>= 1) {
+        if (index & 1)
+            x ^= v[k];
+    }
+
+    return UintToUnitFloat(NestedUniformScramble(x, HashCombine(seed, dimension % 4)));
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <glm/glm.hpp>
+
+using namespace glm;
+
+// Same generator as HybridTaus in the shaders, one number per call
+float HybridTaus(uvec4& state);
+
+constexpr uint32_t kRandomLanes = 8;
+
+// The sequential generators give every sample this many numbers before running into the next sample's
+constexpr uint32_t kRandomDimensionsPerSample = 1 << 10;
+
+enum class RandomGenerator {
+	HYBRID_TAUS, // Same steps as the shaders, handy when comparing the CPU and GPU renderers
+	PCG32,       // [O'Neill 2014]
+	PHILOX,      // Philox4x32-10 [Salmon et al. 2011], counter based so any number can be computed directly
+};
+
+/*
+Eight random streams that are advanced together, with AVX2 when it is available
+Lane i holds sample firstSample + i of the stream named by key, which for the reference renderer is the pixel index
+The numbers a sample sees only depend on the key, the sample index, and the dimension, so renders come out the same regardless of threading or tile order
+
+Philox gets this for free since its counter is (dimension, sample). HybridTaus and PCG32 are sequential, so they reserve kRandomDimensionsPerSample
+numbers for each sample and jump ahead to the right one: an LCG jumps in O(log n) [Brown 1994], and each Tausworthe component is linear over GF(2)
+so it can jump by multiplying with precomputed powers of its step matrix
+*/
+class RandomStreams8 {
+public:
+	RandomStreams8(RandomGenerator generator, uint64_t key);
+
+	// Moves the lanes to samples [sample, sample + 8)
+	void SkipTo(uint64_t sample);
+	// Same as SkipTo(GetFirstSample() + 8), but the sequential generators only have to jump by a power of two
+	void NextSamples(void);
+
+	// Writes dimensions [firstDimension, firstDimension + count) of every lane, out[8 * i + lane] being dimension firstDimension + i
+	void Fill(float* out, uint32_t firstDimension, uint32_t count) const;
+
+	uint64_t GetFirstSample(void) const;
+private:
+	RandomGenerator generator;
+	uint64_t key;
+	uint64_t firstSample;
+
+	// State of every lane at the first dimension of its sample, Philox does not need any
+	uint32_t taus[4][kRandomLanes];
+	uint64_t pcg[kRandomLanes];
+	uint64_t pcgIncrement;
+};
+
+/*
+Owen scrambled Sobol points, computed on demand from the pixel, sample index, and dimension [Burley 2020, "Practical Hash-based Owen Scrambling"]
+Only the first four Sobol dimensions are used. Every group of four dimensions gets its own shuffled sample order instead, which keeps each group
+well stratified, and the groups uncorrelated with each other. Consecutive dimensions should go together, so 2D samples should start at an even dimension
+*/
+float SobolOwen(uint32_t pixel, uint32_t sample, uint32_t dimension);
@@ -9,11 +9,41 @@ struct Ray {
 	vec3 direction;
 };
 
+/*
+Per-ray constants for watertight ray-triangle intersection [Woop et al. 2013]
+The dominant axis of the direction becomes z, and the other 2 axes are sheared so the ray points straight down z
+These only depend on the ray, so we compute them once before traversal instead of once per triangle
+*/
+struct ShearedRay {
+	ShearedRay(const Ray& ray) {
+		vec3 absDir = abs(ray.direction);
+		kz = (absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) : (absDir.y > absDir.z ? 1 : 2));
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+
+		// Swap to preserve the winding of the triangle
+		if (ray.direction[kz] < 0.0f) {
+			int temp = kx;
+			kx = ky;
+			ky = temp;
+		}
+
+		shear.x = ray.direction[kx] / ray.direction[kz];
+		shear.y = ray.direction[ky] / ray.direction[kz];
+		shear.z = 1.0f / ray.direction[kz];
+	}
+
+	int kx, ky, kz;
+	vec3 shear;
+};
+
 struct HitInfo {
     float depth;
     float u, v, t;
     Vertex intersection;
-    HitInfo() : depth(1e20f) {}
+    // Texture space area over world space area of the hit triangle, which ray cones need to pick a mip level
+    float uvAreaRatio;
+    HitInfo() : depth(1e20f), uvAreaRatio(0.0f) {}
 };
 
 struct Hittable {
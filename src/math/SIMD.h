@@ -0,0 +1,23 @@
+#pragma once
+
+/*
+Which SIMD instruction sets we are allowed to use are decided by the compiler flags, not at runtime
+MSVC does not define __SSE2__ on x64 even though SSE2 is always there, so we have to check _M_X64 too
+AVX/AVX2 are only defined by MSVC with /arch:AVX(2) and by GCC/Clang with -mavx(2)
+*/
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2
+#endif
+
+#if defined(__AVX__)
+#define SIMD_AVX
+#endif
+
+#if defined(__AVX2__)
+#define SIMD_AVX2
+#endif
+
+#ifdef SIMD_SSE2
+#include <immintrin.h>
+#endif
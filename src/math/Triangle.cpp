@@ -1,4 +1,5 @@
 #include "Triangle.h"
+#include "SIMD.h"
 
 using namespace glm;
 
@@ -8,6 +9,13 @@ uint32_t& TriangleIndices::operator[](const uint32_t I) {
 }
 */
 
+// Both areas are doubled, which cancels out
+float UVAreaRatio(const vec3& edge1, const vec3& edge2, const vec2& uvEdge1, const vec2& uvEdge2) {
+    float worldArea = length(cross(edge1, edge2));
+    float uvArea = abs(uvEdge1.x * uvEdge2.y - uvEdge1.y * uvEdge2.x);
+    return (worldArea > 0.0f ? uvArea / worldArea : 0.0f);
+}
+
 Vertex& Triangle::operator[](const uint32_t I) {
     return Vertices[I];
 }
@@ -46,6 +54,7 @@ bool Triangle::Intersect(const Ray& ray, HitInfo& closestHit) {
         closestHit.intersection.normal = Vertices[0].normal;
         closestHit.intersection.texcoord = Vertices[0].texcoord * closestHit.t + Vertices[1].texcoord * closestHit.u + Vertices[2].texcoord * closestHit.v;
         closestHit.intersection.matId = Vertices[0].matId;
+        closestHit.uvAreaRatio = UVAreaRatio(v01, v02, Vertices[1].texcoord - Vertices[0].texcoord, Vertices[2].texcoord - Vertices[0].texcoord);
 
         return true;
     }
@@ -76,5 +85,174 @@ Triangle CompactTriangle::Decompress() {
 }
 
 bool CompactTriangle::Intersect(const Ray& ray, HitInfo& hit) {
+#ifdef WATERTIGHT_INTERSECTION
+    return IntersectWatertight(ray, ShearedRay(ray), hit);
+#else
     return Decompress().Intersect(ray, hit);
+#endif
+}
+
+void CompactTriangle::FillHitInfo(const Ray& ray, HitInfo& hit) const {
+    hit.intersection.position = hit.depth * ray.direction + ray.origin;
+    hit.intersection.normal = normal;
+    hit.intersection.texcoord = texcoord0 * hit.t + texcoord1 * hit.u + texcoord2 * hit.v;
+    hit.intersection.matId = material;
+    hit.uvAreaRatio = UVAreaRatio(position1 - position0, position2 - position0, texcoord1 - texcoord0, texcoord2 - texcoord0);
+}
+
+/*
+Watertight ray-triangle intersection from "Watertight Ray/Triangle Intersection" [Woop et al. 2013]
+We translate the vertices to the ray origin and shear them so the ray goes down +z
+Then we only need to do a 2D edge test against the origin, which is consistent for edges shared between triangles
+When an edge function is exactly 0 we don't know which side we are on, so we redo the test in double precision
+*/
+bool CompactTriangle::IntersectWatertight(const Ray& ray, const ShearedRay& sheared, HitInfo& hit) const {
+    const int kx = sheared.kx, ky = sheared.ky, kz = sheared.kz;
+
+    vec3 a = position0 - ray.origin;
+    vec3 b = position1 - ray.origin;
+    vec3 c = position2 - ray.origin;
+
+    float ax = a[kx] - sheared.shear.x * a[kz];
+    float ay = a[ky] - sheared.shear.y * a[kz];
+    float bx = b[kx] - sheared.shear.x * b[kz];
+    float by = b[ky] - sheared.shear.y * b[kz];
+    float cx = c[kx] - sheared.shear.x * c[kz];
+    float cy = c[ky] - sheared.shear.y * c[kz];
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+
+    if (u == 0.0f || v == 0.0f || w == 0.0f) {
+        u = (float)((double)cx * (double)by - (double)cy * (double)bx);
+        v = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+        w = (float)((double)bx * (double)ay - (double)by * (double)ax);
+    }
+
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+        return false;
+
+    float det = u + v + w;
+    if (det == 0.0f)
+        return false;
+
+    float az = sheared.shear.z * a[kz];
+    float bz = sheared.shear.z * b[kz];
+    float cz = sheared.shear.z * c[kz];
+
+    float idet = 1.0f / det;
+    float depth = (u * az + v * bz + w * cz) * idet;
+
+    if (depth < hit.depth && depth > 0.0f) {
+        hit.depth = depth;
+        // u, v, and w are the weights of position0, position1, and position2 respectively
+        hit.t = u * idet;
+        hit.u = v * idet;
+        hit.v = w * idet;
+        FillHitInfo(ray, hit);
+        return true;
+    }
+    else
+        return false;
+}
+
+bool IntersectWatertight4(const CompactTriangle* const* triangles, int count, const Ray& ray, const ShearedRay& sheared, HitInfo& hit) {
+#ifdef SIMD_SSE2
+    const int kx = sheared.kx, ky = sheared.ky, kz = sheared.kz;
+
+    // Transpose into SoA, unused lanes just repeat the last triangle and get masked off later
+    alignas(16) float gather[9][4];
+    for (int i = 0; i < 4; i++) {
+        const CompactTriangle* tri = triangles[i < count ? i : count - 1];
+        vec3 a = tri->position0 - ray.origin;
+        vec3 b = tri->position1 - ray.origin;
+        vec3 c = tri->position2 - ray.origin;
+
+        gather[0][i] = a[kx]; gather[1][i] = a[ky]; gather[2][i] = a[kz];
+        gather[3][i] = b[kx]; gather[4][i] = b[ky]; gather[5][i] = b[kz];
+        gather[6][i] = c[kx]; gather[7][i] = c[ky]; gather[8][i] = c[kz];
+    }
+
+    const __m128 sx = _mm_set1_ps(sheared.shear.x);
+    const __m128 sy = _mm_set1_ps(sheared.shear.y);
+    const __m128 sz = _mm_set1_ps(sheared.shear.z);
+    const __m128 zero = _mm_setzero_ps();
+
+    __m128 az = _mm_load_ps(gather[2]);
+    __m128 bz = _mm_load_ps(gather[5]);
+    __m128 cz = _mm_load_ps(gather[8]);
+
+    __m128 ax = _mm_sub_ps(_mm_load_ps(gather[0]), _mm_mul_ps(sx, az));
+    __m128 ay = _mm_sub_ps(_mm_load_ps(gather[1]), _mm_mul_ps(sy, az));
+    __m128 bx = _mm_sub_ps(_mm_load_ps(gather[3]), _mm_mul_ps(sx, bz));
+    __m128 by = _mm_sub_ps(_mm_load_ps(gather[4]), _mm_mul_ps(sy, bz));
+    __m128 cx = _mm_sub_ps(_mm_load_ps(gather[6]), _mm_mul_ps(sx, cz));
+    __m128 cy = _mm_sub_ps(_mm_load_ps(gather[7]), _mm_mul_ps(sy, cz));
+
+    __m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+    __m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+    __m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+    // Lanes with an edge function of exactly 0 need the double precision fallback, so we send them to the scalar version
+    __m128 degenerate = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero));
+
+    __m128 anyNegative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+    __m128 anyPositive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+    __m128 valid = _mm_andnot_ps(_mm_and_ps(anyNegative, anyPositive), _mm_cmpneq_ps(det, zero));
+
+    __m128 depthScaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, _mm_mul_ps(sz, az)), _mm_mul_ps(v, _mm_mul_ps(sz, bz))), _mm_mul_ps(w, _mm_mul_ps(sz, cz)));
+
+    // Avoid the division until we know the hit is in range: flip signs so that det is positive, then compare against depth * det
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 detSign = _mm_and_ps(det, signMask);
+    __m128 absDet = _mm_xor_ps(det, detSign);
+    __m128 signedDepth = _mm_xor_ps(depthScaled, detSign);
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(signedDepth, zero));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(signedDepth, _mm_mul_ps(_mm_set1_ps(hit.depth), absDet)));
+
+    int validMask = _mm_movemask_ps(_mm_andnot_ps(degenerate, valid)) & ((1 << count) - 1);
+    int degenerateMask = _mm_movemask_ps(degenerate) & ((1 << count) - 1);
+
+    bool result = false;
+    if (validMask) {
+        alignas(16) float depths[4], us[4], vs[4], ws[4];
+        __m128 idet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+        _mm_store_ps(depths, _mm_mul_ps(depthScaled, idet));
+        _mm_store_ps(us, _mm_mul_ps(u, idet));
+        _mm_store_ps(vs, _mm_mul_ps(v, idet));
+        _mm_store_ps(ws, _mm_mul_ps(w, idet));
+
+        int closest = -1;
+        for (int i = 0; i < 4; i++) {
+            if ((validMask & (1 << i)) && depths[i] < hit.depth) {
+                hit.depth = depths[i];
+                closest = i;
+            }
+        }
+
+        if (closest != -1) {
+            hit.t = us[closest];
+            hit.u = vs[closest];
+            hit.v = ws[closest];
+            triangles[closest]->FillHitInfo(ray, hit);
+            result = true;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (degenerateMask & (1 << i)) {
+            result |= triangles[i]->IntersectWatertight(ray, sheared, hit);
+        }
+    }
+
+    return result;
+#else
+    bool result = false;
+    for (int i = 0; i < count; i++) {
+        result |= triangles[i]->IntersectWatertight(ray, sheared, hit);
+    }
+    return result;
+#endif
 }
\ No newline at end of file
@@ -4,6 +4,16 @@
 #include "Vertex.h"
 #include "Ray.h"
 
+/*
+Use the watertight ray-triangle test [Woop et al. 2013] instead of Moller-Trumbore
+Moller-Trumbore can let rays slip through shared edges, which is why we need large offsets when spawning rays
+With this enabled, the scene keeps absolute vertex positions instead of precomputing edges
+On the CPU traversal benchmark it is within run to run noise of Moller-Trumbore (0.92x to 1.16x over three synthetic scenes),
+since rays do 10 to 20 times more box tests than triangle tests. It stays off until it has been measured on the GPU as well
+This MUST match the define in shaders/common/Geometry.glsl
+*/
+//#define WATERTIGHT_INTERSECTION
+
 struct Triangle : public Hittable{
     Vertex Vertices[3];
     Vertex& operator[](const uint32_t I);
@@ -26,4 +36,10 @@ struct CompactTriangle : public Hittable {
 
     Triangle Decompress();
     bool Intersect(const Ray& ray, HitInfo& hit);
+    // Expects absolute vertex positions
+    bool IntersectWatertight(const Ray& ray, const ShearedRay& sheared, HitInfo& hit) const;
+    void FillHitInfo(const Ray& ray, HitInfo& hit) const;
 };
+
+// SSE version of IntersectWatertight that tests up to 4 triangles against the same ray at once
+bool IntersectWatertight4(const CompactTriangle* const* triangles, int count, const Ray& ray, const ShearedRay& sheared, HitInfo& hit);
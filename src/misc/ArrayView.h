@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include <stdexcept>
+
+/*
+Read only view of an array that someone else owns, so that the CPU renderer can trace against a std::vector or straight out of a mapped file
+It converts implicitly from a vector and has the parts of the vector interface that the traversal uses
+*/
+template<typename T>
+class ArrayView {
+public:
+	ArrayView(void) : elements(nullptr), count(0) {}
+	ArrayView(const T* elements, size_t count) : elements(elements), count(count) {}
+	ArrayView(const std::vector<T>& vector) : elements(vector.data()), count(vector.size()) {}
+
+	const T& operator[](size_t i) const {
+		return elements[i];
+	}
+
+	const T& at(size_t i) const {
+		if (i >= count)
+			throw std::out_of_range("ArrayView index out of range");
+		return elements[i];
+	}
+
+	const T& front(void) const {
+		return elements[0];
+	}
+
+	const T* begin(void) const {
+		return elements;
+	}
+
+	const T* end(void) const {
+		return elements + count;
+	}
+
+	const T* data(void) const {
+		return elements;
+	}
+
+	size_t size(void) const {
+		return count;
+	}
+
+	bool empty(void) const {
+		return count == 0;
+	}
+private:
+	const T* elements;
+	size_t count;
+};
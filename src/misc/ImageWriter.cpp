@@ -0,0 +1,247 @@
+#include "ImageWriter.h"
+#include "../math/Half.h"
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <filesystem>
+#include <SOIL2.h>
+
+using namespace glm;
+
+const char* GetHDRExtension(HDRFormat format) {
+	return (format == HDRFormat::PFM ? ".pfm" : ".exr");
+}
+
+// Writes to a temporary file with the given function and then moves it over the real path
+bool WriteAtomically(const std::string& path, const std::function<bool(FILE*)>& write) {
+	std::string temporaryPath = path + ".tmp";
+
+	std::error_code error;
+	size_t slash = path.rfind('/');
+	if (slash != std::string::npos)
+		std::filesystem::create_directories(path.substr(0, slash), error);
+
+	FILE* file = fopen(temporaryPath.c_str(), "wb");
+	if (!file) {
+		std::cout << "File \"" << path << "\" failed to save!\n";
+		return false;
+	}
+
+	bool written = write(file);
+	written &= (fclose(file) == 0);
+
+	if (written)
+		std::filesystem::rename(temporaryPath, path, error);
+
+	if (!written || error) {
+		std::filesystem::remove(temporaryPath, error);
+		std::cout << "File \"" << path << "\" failed to save!\n";
+		return false;
+	}
+
+	return true;
+}
+
+/*
+Portable float map, see http://www.pauldebevec.com/Research/HDR/PFM/
+A negative scale means little endian, and the rows already go from the bottom up
+*/
+bool WritePFM(const std::string& path, uint32_t width, uint32_t height, const std::vector<vec3>& pixels) {
+	return WriteAtomically(path, [&](FILE* file) {
+		fprintf(file, "PF\n%u %u\n-1.0\n", width, height);
+		static_assert(sizeof(vec3) == 3 * sizeof(float), "PFM pixels are written straight from the vector");
+		return fwrite(pixels.data(), sizeof(vec3), (size_t)width * height, file) == (size_t)width * height;
+	});
+}
+
+/*
+Just enough of OpenEXR for an uncompressed scanline image, see "The OpenEXR File Layout"
+The header is a list of attributes (name, type, size, value), followed by a table with the file offset of every scanline
+Each scanline stores its y and size, and then every channel of the line one after the other, in alphabetical order
+*/
+class EXRHeaderBuilder {
+public:
+	void Attribute(const char* name, const char* type, const void* value, uint32_t size) {
+		Bytes(name, strlen(name) + 1);
+		Bytes(type, strlen(type) + 1);
+		Bytes(&size, sizeof(size));
+		Bytes(value, size);
+	}
+
+	void Bytes(const void* data, size_t size) {
+		const uint8_t* begin = (const uint8_t*)data;
+		header.insert(header.end(), begin, begin + size);
+	}
+
+	std::vector<uint8_t> header;
+};
+
+bool WriteEXR(const std::string& path, uint32_t width, uint32_t height, const std::vector<vec3>& pixels, bool half) {
+	constexpr uint32_t kEXRMagic = 20000630;
+	constexpr uint32_t kEXRVersion = 2; // Single part scanline image, no flags
+	constexpr int32_t kEXRPixelTypeHalf = 1;
+	constexpr int32_t kEXRPixelTypeFloat = 2;
+
+	EXRHeaderBuilder builder;
+	builder.Bytes(&kEXRMagic, sizeof(kEXRMagic));
+	builder.Bytes(&kEXRVersion, sizeof(kEXRVersion));
+
+	// Each channel is its name, the pixel type, whether it is perceptually linear plus 3 reserved bytes, and the x and y subsampling
+	std::vector<uint8_t> channels;
+	for (const char* name : { "B", "G", "R" }) {
+		int32_t description[4] = { half ? kEXRPixelTypeHalf : kEXRPixelTypeFloat, 0, 1, 1 };
+		channels.insert(channels.end(), name, name + 2);
+		channels.insert(channels.end(), (const uint8_t*)description, (const uint8_t*)(description + 4));
+	}
+	channels.push_back(0);
+	builder.Attribute("channels", "chlist", channels.data(), (uint32_t)channels.size());
+
+	uint8_t compression = 0; // NO_COMPRESSION
+	builder.Attribute("compression", "compression", &compression, sizeof(compression));
+
+	int32_t window[4] = { 0, 0, (int32_t)width - 1, (int32_t)height - 1 };
+	builder.Attribute("dataWindow", "box2i", window, sizeof(window));
+	builder.Attribute("displayWindow", "box2i", window, sizeof(window));
+
+	uint8_t lineOrder = 0; // INCREASING_Y
+	builder.Attribute("lineOrder", "lineOrder", &lineOrder, sizeof(lineOrder));
+
+	float pixelAspectRatio = 1.0f;
+	builder.Attribute("pixelAspectRatio", "float", &pixelAspectRatio, sizeof(pixelAspectRatio));
+
+	float screenWindowCenter[2] = { 0.0f, 0.0f };
+	builder.Attribute("screenWindowCenter", "v2f", screenWindowCenter, sizeof(screenWindowCenter));
+
+	float screenWindowWidth = 1.0f;
+	builder.Attribute("screenWindowWidth", "float", &screenWindowWidth, sizeof(screenWindowWidth));
+
+	uint8_t endOfHeader = 0;
+	builder.Bytes(&endOfHeader, sizeof(endOfHeader));
+
+	uint32_t sampleSize = (half ? sizeof(uint16_t) : sizeof(float));
+	uint32_t lineDataSize = 3 * width * sampleSize;
+	uint64_t firstLine = builder.header.size() + (uint64_t)height * sizeof(uint64_t);
+
+	std::vector<uint64_t> offsets(height);
+	for (uint32_t y = 0; y < height; y++)
+		offsets[y] = firstLine + (uint64_t)y * (2 * sizeof(int32_t) + lineDataSize);
+
+	return WriteAtomically(path, [&](FILE* file) {
+		bool written =
+			fwrite(builder.header.data(), 1, builder.header.size(), file) == builder.header.size() &&
+			fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file) == offsets.size();
+
+		std::vector<uint8_t> line(lineDataSize);
+		for (uint32_t y = 0; y < height && written; y++) {
+			// EXR goes from the top down
+			const vec3* row = &pixels[(size_t)(height - y - 1) * width];
+			for (uint32_t c = 0; c < 3; c++) {
+				int channel = 2 - c; // B, G, R
+				uint8_t* dst = &line[(size_t)c * width * sampleSize];
+				for (uint32_t x = 0; x < width; x++) {
+					if (half) {
+						uint16_t value = FloatToHalf(row[x][channel]);
+						memcpy(dst + x * sizeof(uint16_t), &value, sizeof(value));
+					}
+					else
+						memcpy(dst + x * sizeof(float), &row[x][channel], sizeof(float));
+				}
+			}
+
+			int32_t lineHeader[2] = { (int32_t)y, (int32_t)lineDataSize };
+			written &= fwrite(lineHeader, sizeof(lineHeader), 1, file) == 1;
+			written &= fwrite(line.data(), 1, line.size(), file) == line.size();
+		}
+
+		return written;
+	});
+}
+
+bool WriteHDR(const std::string& path, uint32_t width, uint32_t height, const std::vector<vec3>& pixels, HDRFormat format) {
+	if (format == HDRFormat::PFM)
+		return WritePFM(path, width, height, pixels);
+	else
+		return WriteEXR(path, width, height, pixels, format == HDRFormat::EXR_HALF);
+}
+
+bool WritePNG(const std::string& path, uint32_t width, uint32_t height, const std::vector<uint8_t>& pixels) {
+	std::error_code error;
+	size_t slash = path.rfind('/');
+	if (slash != std::string::npos)
+		std::filesystem::create_directories(path.substr(0, slash), error);
+
+	// SOIL picks the format from its argument rather than the extension, so the temporary name is fine
+	std::string temporaryPath = path + ".tmp";
+	if (SOIL_save_image(temporaryPath.c_str(), SOIL_SAVE_TYPE_PNG, width, height, 3, pixels.data()))
+		std::filesystem::rename(temporaryPath, path, error);
+	else
+		error = std::make_error_code(std::errc::io_error);
+
+	if (error) {
+		std::filesystem::remove(temporaryPath, error);
+		std::cout << "File \"" << path << "\" failed to save!\n";
+		return false;
+	}
+
+	return true;
+}
+
+BackgroundImageWriter::BackgroundImageWriter(void) : busy(false), exiting(false), thread(&BackgroundImageWriter::Run, this) {}
+
+BackgroundImageWriter::~BackgroundImageWriter(void) {
+	mutex.lock();
+	exiting = true;
+	mutex.unlock();
+	wake.notify_one();
+
+	thread.join();
+}
+
+void BackgroundImageWriter::WriteHDR(const std::string& path, uint32_t width, uint32_t height, std::vector<vec3> pixels, HDRFormat format) {
+	Enqueue([path, width, height, pixels = std::move(pixels), format]() {
+		if (::WriteHDR(path, width, height, pixels, format))
+			std::cout << "File \"" << path << "\" saved successfully\n";
+	});
+}
+
+void BackgroundImageWriter::WritePNG(const std::string& path, uint32_t width, uint32_t height, std::vector<uint8_t> pixels) {
+	Enqueue([path, width, height, pixels = std::move(pixels)]() {
+		if (::WritePNG(path, width, height, pixels))
+			std::cout << "File \"" << path << "\" saved successfully\n";
+	});
+}
+
+void BackgroundImageWriter::Flush(void) {
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [this]() { return jobs.empty() && !busy; });
+}
+
+void BackgroundImageWriter::Enqueue(std::function<void(void)> job) {
+	mutex.lock();
+	jobs.push_back(std::move(job));
+	mutex.unlock();
+	wake.notify_one();
+}
+
+void BackgroundImageWriter::Run(void) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		wake.wait(lock, [this]() { return !jobs.empty() || exiting; });
+
+		// Finish what was queued before exiting so that no image is lost
+		if (jobs.empty())
+			return;
+
+		std::function<void(void)> job = std::move(jobs.front());
+		jobs.pop_front();
+		busy = true;
+
+		lock.unlock();
+		job();
+		lock.lock();
+
+		busy = false;
+		if (jobs.empty())
+			idle.notify_all();
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <glm/glm.hpp>
+
+enum class HDRFormat {
+	PFM,       // Raw 32 bit floats, which almost anything can read
+	EXR_HALF,  // Uncompressed OpenEXR with 16 bit floats, half the size and still plenty of range
+	EXR_FLOAT, // Uncompressed OpenEXR with 32 bit floats
+};
+
+// File extension that goes with a format, including the dot
+const char* GetHDRExtension(HDRFormat format);
+
+/*
+HDR writers for linear radiance. Rows go from the bottom of the image to the top, like OpenGL, and the writers flip them when the format wants them the other way
+Each file is written next to its final path first and then moved into place, so that nobody ever reads half of an image
+*/
+bool WritePFM(const std::string& path, uint32_t width, uint32_t height, const std::vector<glm::vec3>& pixels);
+bool WriteEXR(const std::string& path, uint32_t width, uint32_t height, const std::vector<glm::vec3>& pixels, bool half);
+bool WriteHDR(const std::string& path, uint32_t width, uint32_t height, const std::vector<glm::vec3>& pixels, HDRFormat format);
+// 8 bit RGB, with rows from the top of the image to the bottom
+bool WritePNG(const std::string& path, uint32_t width, uint32_t height, const std::vector<uint8_t>& pixels);
+
+/*
+Writes images on its own thread so that the renderer can get back to work right away
+Jobs run in the order they were queued, and the destructor waits for all of them
+*/
+class BackgroundImageWriter {
+public:
+	BackgroundImageWriter(void);
+	~BackgroundImageWriter(void);
+
+	void WriteHDR(const std::string& path, uint32_t width, uint32_t height, std::vector<glm::vec3> pixels, HDRFormat format);
+	// 8 bit RGB, with rows from the top of the image to the bottom
+	void WritePNG(const std::string& path, uint32_t width, uint32_t height, std::vector<uint8_t> pixels);
+
+	// Any other work that should stay off the render thread, like converting an image right before it is written
+	void Enqueue(std::function<void(void)> job);
+
+	// Blocks until everything queued so far is on disk
+	void Flush(void);
+private:
+	void Run(void);
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	std::deque<std::function<void(void)>> jobs;
+	bool busy;
+	bool exiting;
+
+	// Started last so that everything above is ready when it runs
+	std::thread thread;
+};
@@ -0,0 +1,101 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+
+MappedFile::MappedFile(void) : data(nullptr), size(0), file(INVALID_HANDLE_VALUE), mapping(nullptr) {}
+
+bool MappedFile::Open(const std::string& path) {
+	Close();
+
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		Close();
+		return false;
+	}
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping) {
+		Close();
+		return false;
+	}
+
+	data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data) {
+		Close();
+		return false;
+	}
+
+	size = (size_t)fileSize.QuadPart;
+	return true;
+}
+
+void MappedFile::Close(void) {
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+
+	data = nullptr;
+	size = 0;
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+}
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(void) : data(nullptr), size(0) {}
+
+bool MappedFile::Open(const std::string& path) {
+	Close();
+
+	int descriptor = open(path.c_str(), O_RDONLY);
+	if (descriptor == -1)
+		return false;
+
+	struct stat status;
+	if (fstat(descriptor, &status) != 0 || status.st_size == 0) {
+		close(descriptor);
+		return false;
+	}
+
+	// The mapping keeps the file alive on its own, so the descriptor can go right away
+	void* mapped = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_SHARED, descriptor, 0);
+	close(descriptor);
+	if (mapped == MAP_FAILED)
+		return false;
+
+	data = (const uint8_t*)mapped;
+	size = (size_t)status.st_size;
+	return true;
+}
+
+void MappedFile::Close(void) {
+	if (data)
+		munmap((void*)data, size);
+
+	data = nullptr;
+	size = 0;
+}
+#endif
+
+MappedFile::~MappedFile(void) {
+	Close();
+}
+
+const uint8_t* MappedFile::GetData(void) const {
+	return data;
+}
+
+size_t MappedFile::GetSize(void) const {
+	return size;
+}
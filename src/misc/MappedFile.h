@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/*
+Maps a whole file into memory read only, so that every process that maps the same file shares one copy of it through the page cache
+Uses mmap everywhere except Windows, where it uses a file mapping object
+*/
+class MappedFile {
+public:
+	MappedFile(void);
+	~MappedFile(void);
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool Open(const std::string& path);
+	void Close(void);
+
+	const uint8_t* GetData(void) const;
+	size_t GetSize(void) const;
+private:
+	const uint8_t* data;
+	size_t size;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#endif
+};
@@ -0,0 +1,186 @@
+#include "Network.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#include <mutex>
+
+typedef int SocketLength;
+constexpr SocketHandle kInvalidSocket = (SocketHandle)INVALID_SOCKET;
+constexpr int kSendFlags = 0;
+
+void CloseSocketHandle(SocketHandle handle) {
+	closesocket((SOCKET)handle);
+}
+
+// Winsock has to be started before anything else touches it, and it is simplest to never stop it again
+void InitializeSockets(void) {
+	static std::once_flag initialized;
+	std::call_once(initialized, []() {
+		WSADATA data;
+		WSAStartup(MAKEWORD(2, 2), &data);
+	});
+}
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+typedef socklen_t SocketLength;
+constexpr SocketHandle kInvalidSocket = -1;
+// A worker that dies mid send would otherwise kill the whole process with SIGPIPE
+#ifdef MSG_NOSIGNAL
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+
+void CloseSocketHandle(SocketHandle handle) {
+	close(handle);
+}
+
+void InitializeSockets(void) {}
+#endif
+
+bool MakeAddress(const char* address, uint16_t port, sockaddr_in& result) {
+	memset(&result, 0, sizeof(result));
+	result.sin_family = AF_INET;
+	result.sin_port = htons(port);
+	return inet_pton(AF_INET, address, &result.sin_addr) == 1;
+}
+
+Socket::Socket(void) : handle(kInvalidSocket) {}
+
+Socket::~Socket(void) {
+	Close();
+}
+
+Socket::Socket(Socket&& other) : handle(other.handle) {
+	other.handle = kInvalidSocket;
+}
+
+Socket& Socket::operator=(Socket&& other) {
+	if (this != &other) {
+		Close();
+		handle = other.handle;
+		other.handle = kInvalidSocket;
+	}
+	return *this;
+}
+
+bool Socket::Listen(const char* address, uint16_t port, int backlog) {
+	InitializeSockets();
+	Close();
+
+	sockaddr_in bindAddress;
+	if (!MakeAddress(address, port, bindAddress))
+		return false;
+
+	handle = (SocketHandle)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (handle == kInvalidSocket)
+		return false;
+
+	if (bind(handle, (sockaddr*)&bindAddress, sizeof(bindAddress)) != 0 || listen(handle, backlog) != 0) {
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+uint16_t Socket::GetPort(void) const {
+	sockaddr_in boundAddress;
+	SocketLength length = sizeof(boundAddress);
+	if (getsockname(handle, (sockaddr*)&boundAddress, &length) != 0)
+		return 0;
+	return ntohs(boundAddress.sin_port);
+}
+
+bool Socket::Accept(Socket& client, double timeout) {
+	fd_set readable;
+	FD_ZERO(&readable);
+	FD_SET(handle, &readable);
+
+	timeval wait;
+	wait.tv_sec = (long)timeout;
+	wait.tv_usec = (long)((timeout - (double)wait.tv_sec) * 1e6);
+
+	// The first argument is ignored on Windows
+	if (select((int)handle + 1, &readable, nullptr, nullptr, &wait) <= 0)
+		return false;
+
+	SocketHandle accepted = (SocketHandle)accept(handle, nullptr, nullptr);
+	if (accepted == kInvalidSocket)
+		return false;
+
+	// Jobs are tiny and each one waits on the last, so Nagle's algorithm would only add latency
+	int noDelay = 1;
+	setsockopt(accepted, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+	client.Close();
+	client.handle = accepted;
+	return true;
+}
+
+bool Socket::Connect(const char* address, uint16_t port) {
+	InitializeSockets();
+	Close();
+
+	sockaddr_in serverAddress;
+	if (!MakeAddress(address, port, serverAddress))
+		return false;
+
+	handle = (SocketHandle)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (handle == kInvalidSocket)
+		return false;
+
+	if (connect(handle, (sockaddr*)&serverAddress, sizeof(serverAddress)) != 0) {
+		Close();
+		return false;
+	}
+
+	int noDelay = 1;
+	setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+	return true;
+}
+
+bool Socket::Send(const void* data, size_t size) {
+	const char* bytes = (const char*)data;
+	while (size > 0) {
+		int chunk = (int)(size < (1U << 30) ? size : (1U << 30));
+		int sent = (int)send(handle, bytes, chunk, kSendFlags);
+		if (sent <= 0)
+			return false;
+		bytes += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+bool Socket::Receive(void* data, size_t size) {
+	char* bytes = (char*)data;
+	while (size > 0) {
+		int chunk = (int)(size < (1U << 30) ? size : (1U << 30));
+		int received = (int)recv(handle, bytes, chunk, 0);
+		if (received <= 0)
+			return false;
+		bytes += received;
+		size -= received;
+	}
+	return true;
+}
+
+bool Socket::IsOpen(void) const {
+	return handle != kInvalidSocket;
+}
+
+void Socket::Close(void) {
+	if (handle != kInvalidSocket)
+		CloseSocketHandle(handle);
+	handle = kInvalidSocket;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+typedef uintptr_t SocketHandle;
+#else
+typedef int SocketHandle;
+#endif
+
+/*
+Blocking TCP socket, just enough for the distributed reference renderer to hand out tiles and get them back
+Send and Receive always move the whole buffer, and return false once the other end is gone
+*/
+class Socket {
+public:
+	Socket(void);
+	~Socket(void);
+
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+	Socket(Socket&& other);
+	Socket& operator=(Socket&& other);
+
+	// Port 0 lets the OS pick a free port, which GetPort returns afterwards
+	bool Listen(const char* address, uint16_t port, int backlog);
+	uint16_t GetPort(void) const;
+	// Waits up to timeout seconds for a connection
+	bool Accept(Socket& client, double timeout);
+
+	bool Connect(const char* address, uint16_t port);
+
+	bool Send(const void* data, size_t size);
+	bool Receive(void* data, size_t size);
+
+	bool IsOpen(void) const;
+	void Close(void);
+private:
+	SocketHandle handle;
+};
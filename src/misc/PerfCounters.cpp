@@ -0,0 +1,76 @@
+#include "PerfCounters.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+
+int OpenHardwareCounter(uint64_t config) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t ReadHardwareCounter(int descriptor) {
+	uint64_t value = 0;
+	if (read(descriptor, &value, sizeof(value)) != sizeof(value))
+		return 0;
+	return value;
+}
+
+CacheMissCounter::CacheMissCounter(void) : Misses(0), References(0) {
+	missDescriptor = OpenHardwareCounter(PERF_COUNT_HW_CACHE_MISSES);
+	referenceDescriptor = OpenHardwareCounter(PERF_COUNT_HW_CACHE_REFERENCES);
+}
+
+CacheMissCounter::~CacheMissCounter(void) {
+	if (missDescriptor != -1)
+		close(missDescriptor);
+	if (referenceDescriptor != -1)
+		close(referenceDescriptor);
+}
+
+bool CacheMissCounter::IsAvailable(void) {
+	return missDescriptor != -1 && referenceDescriptor != -1;
+}
+
+void CacheMissCounter::Begin(void) {
+	if (!IsAvailable())
+		return;
+
+	ioctl(missDescriptor, PERF_EVENT_IOC_RESET, 0);
+	ioctl(referenceDescriptor, PERF_EVENT_IOC_RESET, 0);
+	ioctl(missDescriptor, PERF_EVENT_IOC_ENABLE, 0);
+	ioctl(referenceDescriptor, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+void CacheMissCounter::End(void) {
+	if (!IsAvailable())
+		return;
+
+	ioctl(missDescriptor, PERF_EVENT_IOC_DISABLE, 0);
+	ioctl(referenceDescriptor, PERF_EVENT_IOC_DISABLE, 0);
+	Misses = ReadHardwareCounter(missDescriptor);
+	References = ReadHardwareCounter(referenceDescriptor);
+}
+#else
+CacheMissCounter::CacheMissCounter(void) : Misses(0), References(0), missDescriptor(-1), referenceDescriptor(-1) {}
+CacheMissCounter::~CacheMissCounter(void) {}
+
+bool CacheMissCounter::IsAvailable(void) {
+	return false;
+}
+
+void CacheMissCounter::Begin(void) {}
+void CacheMissCounter::End(void) {}
+#endif
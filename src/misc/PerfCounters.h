@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+Hardware cache miss counter for the traversal benchmark
+Only implemented through perf_event_open on Linux. Everywhere else IsAvailable returns false and you will have to use VTune or uProf instead
+Threads created after Begin are counted too, so start the counter before spawning workers
+*/
+struct CacheMissCounter {
+	CacheMissCounter(void);
+	~CacheMissCounter(void);
+
+	bool IsAvailable(void);
+
+	void Begin(void);
+	void End(void);
+
+	uint64_t Misses;
+	uint64_t References;
+
+private:
+	int missDescriptor;
+	int referenceDescriptor;
+};
@@ -0,0 +1,151 @@
+#include "Process.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+
+std::string GetExecutablePath(void) {
+	char path[MAX_PATH];
+	DWORD length = GetModuleFileNameA(nullptr, path, MAX_PATH);
+	return std::string(path, length);
+}
+
+uint32_t GetOwnProcessId(void) {
+	return (uint32_t)GetCurrentProcessId();
+}
+
+// CreateProcess takes a single command line, so every argument is quoted the way CommandLineToArgvW splits them again
+std::string QuoteArgument(const std::string& argument) {
+	if (!argument.empty() && argument.find_first_of(" \t\"") == std::string::npos)
+		return argument;
+
+	std::string quoted = "\"";
+	size_t backslashes = 0;
+	for (char c : argument) {
+		if (c == '\\') {
+			backslashes++;
+			continue;
+		}
+
+		// Backslashes are only special right before a quote
+		quoted.append(c == '"' ? 2 * backslashes + 1 : backslashes, '\\');
+		quoted.push_back(c);
+		backslashes = 0;
+	}
+	quoted.append(2 * backslashes, '\\');
+	quoted.push_back('"');
+	return quoted;
+}
+
+ChildProcess::ChildProcess(void) : id(0), process(nullptr) {}
+
+ChildProcess::~ChildProcess(void) {
+	if (process)
+		CloseHandle(process);
+}
+
+bool ChildProcess::Launch(const std::vector<std::string>& arguments) {
+	std::string commandLine;
+	for (const std::string& argument : arguments)
+		commandLine += (commandLine.empty() ? "" : " ") + QuoteArgument(argument);
+
+	STARTUPINFOA startup;
+	ZeroMemory(&startup, sizeof(startup));
+	startup.cb = sizeof(startup);
+
+	PROCESS_INFORMATION information;
+	if (!CreateProcessA(arguments.front().c_str(), &commandLine[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &information))
+		return false;
+
+	CloseHandle(information.hThread);
+	process = information.hProcess;
+	id = information.dwProcessId;
+	return true;
+}
+
+int ChildProcess::Wait(void) {
+	if (!process)
+		return -1;
+
+	WaitForSingleObject(process, INFINITE);
+	DWORD exitCode = (DWORD)-1;
+	GetExitCodeProcess(process, &exitCode);
+	CloseHandle(process);
+	process = nullptr;
+	return (int)exitCode;
+}
+
+void ChildProcess::Kill(void) {
+	if (process)
+		TerminateProcess(process, 1);
+}
+#else
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <limits.h>
+
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+
+extern char** environ;
+
+std::string GetExecutablePath(void) {
+	char path[PATH_MAX];
+#ifdef __APPLE__
+	uint32_t size = sizeof(path);
+	if (_NSGetExecutablePath(path, &size) != 0)
+		return std::string();
+	return std::string(path);
+#else
+	ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	return (length > 0 ? std::string(path, length) : std::string());
+#endif
+}
+
+uint32_t GetOwnProcessId(void) {
+	return (uint32_t)getpid();
+}
+
+ChildProcess::ChildProcess(void) : id(0) {}
+
+ChildProcess::~ChildProcess(void) {}
+
+bool ChildProcess::Launch(const std::vector<std::string>& arguments) {
+	std::vector<char*> argv;
+	for (const std::string& argument : arguments)
+		argv.push_back((char*)argument.c_str());
+	argv.push_back(nullptr);
+
+	pid_t pid;
+	if (posix_spawn(&pid, argv.front(), nullptr, nullptr, argv.data(), environ) != 0)
+		return false;
+
+	id = (uint32_t)pid;
+	return true;
+}
+
+int ChildProcess::Wait(void) {
+	if (id == 0)
+		return -1;
+
+	int status = 0;
+	if (waitpid((pid_t)id, &status, 0) != (pid_t)id)
+		return -1;
+
+	// Once the child is reaped the OS can hand its PID to someone else, so Kill must not touch it anymore
+	id = 0;
+	return (WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+void ChildProcess::Kill(void) {
+	if (id == 0)
+		return;
+	kill((pid_t)id, SIGKILL);
+}
+#endif
+
+uint32_t ChildProcess::GetId(void) const {
+	return id;
+}
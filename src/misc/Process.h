@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Full path of the running executable, so that it can launch more copies of itself
+std::string GetExecutablePath(void);
+// Named so that it does not clash with GetCurrentProcessId from Windows.h
+uint32_t GetOwnProcessId(void);
+
+/*
+Child process started with an argument list, which is passed through as is (no shell in between)
+The destructor does not wait for or kill the process, call Wait or Kill first if that matters
+*/
+class ChildProcess {
+public:
+	ChildProcess(void);
+	~ChildProcess(void);
+
+	ChildProcess(const ChildProcess&) = delete;
+	ChildProcess& operator=(const ChildProcess&) = delete;
+
+	bool Launch(const std::vector<std::string>& arguments);
+	// Blocks until the process exits and returns its exit code, or -1 if it never started
+	int Wait(void);
+	// Does nothing once Wait has returned, since the id might belong to another process by then
+	void Kill(void);
+
+	uint32_t GetId(void) const;
+private:
+	uint32_t id;
+#ifdef _WIN32
+	void* process;
+#endif
+};
@@ -353,6 +353,29 @@ struct BVHStackItem {
 uniform samplerBuffer nodesTex;
 uniform samplerBuffer referenceTex;
 
+/*
+Leaf ordered triangles: copies of the triangles laid out in the same order as the references, so a leaf offset works for both
+This skips the dependent reference read at the cost of memory, and the renderer times both forms and sets this to whichever is faster
+The last triangle of a leaf has a nonzero padding value instead of a negated reference
+*/
+uniform samplerBuffer leafTriangleTex;
+uniform bool leafOrderedTriangles;
+
+PackedCompactTriangle ReadLeafTriangle(int idx, out bool last) {
+	idx *= 5;
+
+	PackedCompactTriangle pct;
+
+	pct.data[0] = texelFetch(leafTriangleTex, idx);
+	pct.data[1] = texelFetch(leafTriangleTex, idx + 1);
+	pct.data[2] = texelFetch(leafTriangleTex, idx + 2);
+	pct.data[3] = texelFetch(leafTriangleTex, idx + 3);
+	pct.data[4] = texelFetch(leafTriangleTex, idx + 4);
+
+	last = (fbs(pct.data[4].w) != 0);
+	return pct;
+}
+
 BVHNode GetNode(int idx) {
 	BVHNode node;
 
@@ -424,6 +447,16 @@ void IntersectLeaf(in int leaf, in Ray ray, inout HitInfo intersection, inout bo
 	*/
 	int i = -leaf;
 	bool iterating = true;
+	if (leafOrderedTriangles) {
+		while (iterating) {
+			bool last;
+			bool hit = IntersectTriangle(ReadLeafTriangle(i++, last), ray, intersection);
+			result = result || hit;
+			iterating = !last;
+		}
+		return;
+	}
+
 	while (iterating) {
 		int index = fbs(texelFetch(referenceTex, i++).x);
 		if (index < 0) {
@@ -467,6 +500,17 @@ void IntersectLeaf(in BVHNode leaf, in Ray ray, inout HitInfo intersection, inou
 bool IntersectLeafAny(in int leaf, in Ray ray, inout HitInfo intersection) {
 	int i = -leaf;
 	bool iterating = true;
+	if (leafOrderedTriangles) {
+		while (iterating) {
+			bool last;
+			if (IntersectTriangle(ReadLeafTriangle(i++, last), ray, intersection)) {
+				return true;
+			}
+			iterating = !last;
+		}
+		return false;
+	}
+
 	while (iterating) {
 		int index = fbs(texelFetch(referenceTex, i++).x);
 		if (index < 0) {
@@ -486,7 +530,7 @@ bool IntersectLeafAny(in BVHNode leaf, in Ray ray, inout HitInfo intersection) {
 	return IntersectLeafAny(fbs(leaf.data[0].w), ray, intersection);
 }
 
-#define BVH_STACK_SIZE 27
+#define BVH_STACK_SIZE 27 // Same as in BVH.h, which the sweep builder keeps the depth under
 
 bool StackTraversalClosestHit(in Ray ray, inout HitInfo intersection) {
 	Ray iray;
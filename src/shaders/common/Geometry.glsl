@@ -3,6 +3,9 @@
 
 #include "Util.glsl"
 
+// Must match the define in math/Triangle.h, since it changes how the triangle positions are stored
+//#define WATERTIGHT_INTERSECTION
+
 uniform samplerBuffer vertexTex;
 
 struct Ray {
@@ -310,7 +313,68 @@ bool IntersectTriangleArenberg(in PackedCompactTriangle pct, in Ray ray, inout H
     return true;
 }
 
+// See CompactTriangle::IntersectWatertight for the CPU version. We recompute the shear constants per triangle since they would eat up registers otherwise
+bool IntersectTriangleWatertight(in PackedCompactTriangle pct, in Ray ray, inout HitInfo closestHit) {
+    vec3 absDir = abs(ray.direction);
+    int kz = (absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) : (absDir.y > absDir.z ? 1 : 2));
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (ray.direction[kz] < 0.0f) {
+        int temp = kx;
+        kx = ky;
+        ky = temp;
+    }
+
+    vec3 shear = vec3(ray.direction[kx], ray.direction[ky], 1.0f) / ray.direction[kz];
+
+    vec3 a = vec3(pct.data[0].xyz) - ray.origin;
+    vec3 b = vec3(pct.data[0].w, pct.data[1].xy) - ray.origin;
+    vec3 c = vec3(pct.data[1].zw, pct.data[2].x) - ray.origin;
+
+    vec2 as = vec2(a[kx], a[ky]) - shear.xy * a[kz];
+    vec2 bs = vec2(b[kx], b[ky]) - shear.xy * b[kz];
+    vec2 cs = vec2(c[kx], c[ky]) - shear.xy * c[kz];
+
+    vec3 uvw = vec3(
+        cs.x * bs.y - cs.y * bs.x,
+        as.x * cs.y - as.y * cs.x,
+        bs.x * as.y - bs.y * as.x
+    );
+
+    if (uvw.x == 0.0f || uvw.y == 0.0f || uvw.z == 0.0f) {
+        uvw = vec3(
+            float(double(cs.x) * double(bs.y) - double(cs.y) * double(bs.x)),
+            float(double(as.x) * double(cs.y) - double(as.y) * double(cs.x)),
+            float(double(bs.x) * double(as.y) - double(bs.y) * double(as.x))
+        );
+    }
+
+    if (any(lessThan(uvw, vec3(0.0f))) && any(greaterThan(uvw, vec3(0.0f)))) {
+        return false;
+    }
+
+    float det = uvw.x + uvw.y + uvw.z;
+    if (det == 0.0f) {
+        return false;
+    }
+
+    float idet = 1.0f / det;
+    float depth = dot(uvw, shear.z * vec3(a[kz], b[kz], c[kz])) * idet;
+
+    if (depth < closestHit.di.x && depth > 0.0f) {
+        closestHit.di.xyz = vec3(depth, uvw.yz * idet);
+        closestHit.intersected = pct;
+        return true;
+    }
+    else
+        return false;
+}
+
+#ifdef WATERTIGHT_INTERSECTION
+#define IntersectTriangle(t, r, i) IntersectTriangleWatertight(t, r, i)
+#else
 #define IntersectTriangle(t, r, i) IntersectTriangleMT(t, r, i)
+#endif
 
 Vertex GetInterpolatedVertex(in Ray ray, inout HitInfo intersection) {
     Vertex interpolated;
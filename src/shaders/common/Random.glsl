@@ -72,20 +72,49 @@ float HybridTaus() {
 // https://blog.demofox.org/2017/05/29/when-random-numbers-are-too-random-low-discrepancy-sequences/
 // might be a good source of info
 
-#define rand() HybridTaus()
+/*
+Blue noise dithered sampling [Georgiev and Fajardo 2016]
+Every pixel uses the same low discrepancy sequence, but each dimension is rotated by the pixel's value in that dimension's blue noise tile
+Since every pixel is on the same sample, the error at low sample counts ends up as blue noise on the screen instead of white noise
+The sequence is the 8D R sequence [Roberts 2018], whose steps are the powers of 1 / phi_8, with phi_8 being the positive root of x^9 = x + 1
+We stick to 32 bit integers so that it does not lose precision once the sample count gets large
+Dimensions past the tiles fall back to HybridTaus
+*/
+uniform usamplerBuffer blueNoiseTex;
+uniform int blueNoiseSample;
 
-vec2 Random2D() {
-    return vec2(rand(), rand());
+const uint kBlueNoiseTileSize = 128;
+const uint kBlueNoiseTileArea = kBlueNoiseTileSize * kBlueNoiseTileSize;
+const uint kBlueNoiseDimensions = 8;
+const uint blueNoiseSteps[] = { 3958238937U, 3647910312U, 3361911661U, 3098335500U, 2855423888U, 2631556713U, 2425240876U, 2235100341U };
+
+uint blueNoisePixel;
+uint blueNoiseDimension = kBlueNoiseDimensions;
+
+void InitBlueNoise(ivec2 pixel) {
+    uvec2 tileCoords = uvec2(pixel) % kBlueNoiseTileSize;
+    blueNoisePixel = tileCoords.y * kBlueNoiseTileSize + tileCoords.x;
+    blueNoiseDimension = 0;
 }
 
-samplerBuffer stratifiedTex;
-uniform int stratumIdx;
+float NextSample() {
+    if (blueNoiseDimension >= kBlueNoiseDimensions) {
+        return HybridTaus();
+    }
+
+    // Ranks are turned into the center of their interval of [0, 2^32)
+    uint rank = texelFetch(blueNoiseTex, int(blueNoiseDimension * kBlueNoiseTileArea + blueNoisePixel)).x;
+    uint rotation = (rank << 18) + (1U << 17); // 128 * 128 = 2^14 ranks
+    uint value = rotation + uint(blueNoiseSample) * blueNoiseSteps[blueNoiseDimension];
+    blueNoiseDimension++;
+
+    return 2.3283064365387e-10 * float(value);
+}
 
-const int stride = 16;
+#define rand() NextSample()
 
-vec2 NextStratifiedSample(int idx) {
-    idx *= stride;
-    return texelFetch(stratifiedTex, idx + stratumIdx).xy;
+vec2 Random2D() {
+    return vec2(rand(), rand());
 }
 
 // TODO: find a fast van der corput calculation
@@ -230,6 +259,7 @@ vec2 Random2DStratified() {
 
 
 void initRNG(uint ridx) {
+    blueNoiseDimension = kBlueNoiseDimensions;
     stateIdx = ridx;
     state = states[ridx];
     ldState = ldStates[ridx];